@@ -0,0 +1,203 @@
+#include "matrix.h"
+#include "nn.h"
+#include <time.h>
+
+// Micro benchmarks for the matrix kernels and nn_forward
+// Usage: bench_matrix [--json FILE] [--quick]
+
+
+typedef struct{
+    char name[64];
+    char shape[64];
+    double ns;        // median time of one call
+    double flops;     // floating point operations of one call
+    double bytes;     // bytes read and written by one call
+    double elements;  // output elements of one call, images for nn_forward
+}Result;
+
+#define MAX_RESULTS 128
+
+static Result results[MAX_RESULTS];
+static size_t result_count = 0;
+static double min_time = 0.2; // seconds spent timing each kernel
+static volatile float sink;   // keeps the compiler from dropping the work
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time fn(arg) in 5 rounds of enough calls to fill min_time, returns the median ns per call
+static double time_kernel(void (*fn)(void *), void *arg) {
+    fn(arg); // warm up caches and page in the buffers
+
+    // Calibrate how many calls fit in one round
+    size_t iterations = 1;
+    for (;;) {
+        double start = now();
+        for (size_t i = 0; i < iterations; i++) fn(arg);
+        double elapsed = now() - start;
+        if (elapsed > min_time / 5 || iterations >= (1u << 24)) break;
+        iterations *= 2;
+    }
+
+    double rounds[5];
+    for (int r = 0; r < 5; r++) {
+        double start = now();
+        for (size_t i = 0; i < iterations; i++) fn(arg);
+        rounds[r] = (now() - start) * 1e9 / iterations;
+    }
+    qsort(rounds, 5, sizeof(double), compare_double);
+    return rounds[2];
+}
+
+static void record(const char *name, const char *shape, double ns, double flops, double bytes, double elements) {
+    assert(result_count < MAX_RESULTS);
+    Result *r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->shape, sizeof(r->shape), "%s", shape);
+    r->ns = ns;
+    r->flops = flops;
+    r->bytes = bytes;
+    r->elements = elements;
+
+    printf("%-12s %-16s %12.0f ns %8.3f GFLOP/s %8.3f ns/elem %8.3f GB/s\n",
+           name, shape, ns, flops / ns, ns / elements, bytes / ns);
+}
+
+typedef struct{
+    Mat dst, a, b;
+}DotArgs;
+
+static void run_dot(void *arg) {
+    DotArgs *d = arg;
+    mat_dot(d->dst, d->a, d->b);
+    sink = d->dst.es[0];
+}
+
+// dst (m x n) = a (m x k) * b (k x n)
+static void bench_dot(size_t m, size_t k, size_t n) {
+    DotArgs d = { mat_alloc(m, n), mat_alloc(m, k), mat_alloc(k, n) };
+    mat_rand(d.a, -1, 1);
+    mat_rand(d.b, -1, 1);
+
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%zux%zux%zu", m, k, n);
+    double ns = time_kernel(run_dot, &d);
+    record("mat_dot", shape, ns, 2.0 * m * k * n, 4.0 * (m * k + k * n + m * n), (double)m * n);
+
+    mat_free(d.dst);
+    mat_free(d.a);
+    mat_free(d.b);
+}
+
+static void run_sig(void *arg) {
+    Mat *m = arg;
+    mat_sig(*m);
+    sink = m->es[0];
+}
+
+// Sigmoid in place, one expf, one add and one divide per element
+static void bench_sig(size_t rows, size_t cols) {
+    Mat m = mat_alloc(rows, cols);
+    mat_rand(m, -1, 1);
+
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%zux%zu", rows, cols);
+    double ns = time_kernel(run_sig, &m);
+    double elements = (double)rows * cols;
+    record("mat_sig", shape, ns, 3.0 * elements, 8.0 * elements, elements);
+
+    mat_free(m);
+}
+
+static void run_forward(void *arg) {
+    NN *nn = arg;
+    nn_forward(*nn);
+    sink = NN_OUTPUT(*nn).es[0];
+}
+
+// Whole forward pass of the production architecture over a batch, generic or through the kernel nn_load would pick
+static void bench_forward(size_t *arch, size_t arch_count, size_t batch_size, int specialize) {
+    NN nn = nn_alloc(arch, arch_count);
+    nn_rand(nn, -0.5f, 0.5f);
+    if (specialize) nn_specialize(&nn);
+    NN batch = nn_batch_alloc(nn, batch_size);
+    mat_rand(batch.as[0], 0, 1);
+
+    double flops = 0, bytes = 0;
+    for (size_t i = 0; i < nn.size; i++) {
+        flops += 2.0 * batch_size * nn.ws[i].rows * nn.ws[i].cols;
+        bytes += 4.0 * (nn.ws[i].rows * nn.ws[i].cols + batch_size * (nn.ws[i].rows + nn.ws[i].cols));
+    }
+
+    char shape[64];
+    int len = snprintf(shape, sizeof(shape), "%zu", batch_size);
+    for (size_t i = 0; i < arch_count && len < (int)sizeof(shape); i++) {
+        len += snprintf(shape + len, sizeof(shape) - len, "x%zu", arch[i]);
+    }
+    double ns = time_kernel(run_forward, &batch);
+    record(nn.kernel ? "nn_forward_k" : "nn_forward", shape, ns, flops, bytes, (double)batch_size);
+
+    nn_batch_free(batch);
+    nn_free(nn);
+}
+
+static void write_json(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s for writing.\n", filename);
+        return;
+    }
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < result_count; i++) {
+        Result *r = &results[i];
+        fprintf(file, "  {\"kernel\": \"%s\", \"shape\": \"%s\", \"ns\": %.1f, \"gflops\": %.4f, "
+                      "\"ns_per_element\": %.4f, \"bytes_per_sec\": %.1f}%s\n",
+                r->name, r->shape, r->ns, r->flops / r->ns, r->ns / r->elements, r->bytes / r->ns * 1e9,
+                i + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "]\n");
+    fclose(file);
+    printf("Results written to %s\n", filename);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            min_time = 0.02;
+        } else {
+            fprintf(stderr, "Usage: %s [--json FILE] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    srand(1);
+
+    // Shapes of the 2352-128-10 production model, one image and batches of B images
+    size_t batches[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    size_t batch_count = sizeof(batches) / sizeof(batches[0]);
+
+    for (size_t i = 0; i < batch_count; i++) bench_dot(batches[i], 2352, 128);
+    for (size_t i = 0; i < batch_count; i++) bench_dot(batches[i], 128, 10);
+
+    bench_sig(1, 128);
+    bench_sig(1, 10);
+    bench_sig(256, 128);
+
+    size_t arch[] = {2352, 128, 10};
+    for (size_t i = 0; i < batch_count; i++) bench_forward(arch, 3, batches[i], 0);
+    for (size_t i = 0; i < batch_count; i++) bench_forward(arch, 3, batches[i], 1);
+
+    if (json) write_json(json);
+    return 0;
+}
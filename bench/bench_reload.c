@@ -0,0 +1,189 @@
+#include "nn.h"
+#include "registry.h"
+#include <time.h>
+#include <unistd.h>
+
+// Stress run for registry.h, predictor threads hammer the registry while the model file is
+// rewritten over and over, alternating nn_save (temp file plus rename) and an in place rewrite.
+// Every prediction must match one of the two saved versions bit for bit, every save must be
+// picked up and no weights may be left allocated at the end. Exits 1 otherwise.
+// Usage: bench_reload [--threads N] [--reloads N] [--pause-ms N]
+
+
+#define RELOAD_TIMEOUT 5.0 // seconds to wait for the registry to pick up a save
+
+typedef struct{
+    Registry *registry;
+    const Mat *input;
+    const Mat *expected; // output of version a and b
+    atomic_int *stop;
+
+    size_t predictions;
+    size_t matches[2];
+    size_t mismatches;
+}Predictor;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *predictor_thread(void *arg) {
+    Predictor *p = arg;
+    Model *first = registry_acquire(p->registry);
+    NN ctx = nn_batch_alloc(first->nn, 1);
+    registry_release(first);
+
+    size_t bytes = p->expected[0].cols * sizeof(float);
+    while (!atomic_load(p->stop)) {
+        Model *model = registry_acquire(p->registry);
+        NN nn = model_bind(model, ctx);
+        mat_copy(nn.as[0], *p->input);
+        nn_forward(nn);
+
+        if (memcmp(NN_OUTPUT(nn).es, p->expected[0].es, bytes) == 0) p->matches[0]++;
+        else if (memcmp(NN_OUTPUT(nn).es, p->expected[1].es, bytes) == 0) p->matches[1]++;
+        else p->mismatches++;
+        p->predictions++;
+        registry_release(model);
+    }
+
+    nn_batch_free(ctx);
+    return NULL;
+}
+
+// Rewrite dst in place with the bytes of src, like a tool that doesn't go through nn_save
+static void copy_in_place(const char *src, const char *dst) {
+    FILE *in = fopen(src, "rb");
+    FILE *out = fopen(dst, "wb");
+    assert(in && out);
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) break;
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static unsigned int current_version(Registry *registry) {
+    Model *model = registry_acquire(registry);
+    unsigned int version = model->version;
+    registry_release(model);
+    return version;
+}
+
+// Wait until the registry has swapped in a version after `version`
+static int wait_version(Registry *registry, unsigned int version) {
+    double start = now();
+    while (now() - start < RELOAD_TIMEOUT) {
+        if (current_version(registry) > version) return 1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t threads = 4;
+    int reloads = 50;
+    int pause_ms = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--reloads") == 0 && i + 1 < argc) reloads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--pause-ms") == 0 && i + 1 < argc) pause_ms = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--threads N] [--reloads N] [--pause-ms N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads == 0) threads = 1;
+
+    char dir[] = "/tmp/bench_reload_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("bench_reload: mkdtemp");
+        return 1;
+    }
+    char path[64], tmp_path[80];
+    snprintf(path, sizeof(path), "%s/model.nn", dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/model.nn.tmp", dir);
+
+    MatStats before = mat_stats();
+
+    // Two versions of the same architecture with different weights and their output for a fixed input
+    size_t arch[] = {2352, 128, 10};
+    NN versions[2];
+    Mat expected[2];
+    Mat input = mat_alloc(1, arch[0]);
+    srand(1);
+    mat_rand(input, 0, 1);
+    for (int v = 0; v < 2; v++) {
+        versions[v] = nn_alloc(arch, 3);
+        nn_rand(versions[v], -0.5f, 0.5f);
+        mat_copy(versions[v].as[0], input);
+        nn_forward(versions[v]);
+        expected[v] = mat_alloc(1, arch[2]);
+        mat_copy(expected[v], NN_OUTPUT(versions[v]));
+    }
+
+    nn_save(versions[0], path);
+    Registry *registry = registry_open(path);
+    if (!registry) return 1;
+
+    atomic_int stop = 0;
+    Predictor *predictors = calloc(threads, sizeof(Predictor));
+    pthread_t *handles = malloc(threads * sizeof(pthread_t));
+    for (size_t t = 0; t < threads; t++) {
+        predictors[t] = (Predictor){ .registry = registry, .input = &input, .expected = expected, .stop = &stop };
+        pthread_create(&handles[t], NULL, predictor_thread, &predictors[t]);
+    }
+
+    int missed = 0;
+    double start = now();
+    for (int i = 1; i <= reloads; i++) {
+        unsigned int version = current_version(registry);
+        if (i % 2) {
+            nn_save(versions[i % 2], path);
+        } else {
+            nn_save(versions[i % 2], tmp_path);
+            copy_in_place(tmp_path, path);
+        }
+        if (!wait_version(registry, version)) missed++;
+        usleep(pause_ms * 1000);
+    }
+    double seconds = now() - start;
+
+    atomic_store(&stop, 1);
+    size_t predictions = 0, matches[2] = {0, 0}, mismatches = 0;
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(handles[t], NULL);
+        predictions += predictors[t].predictions;
+        matches[0] += predictors[t].matches[0];
+        matches[1] += predictors[t].matches[1];
+        mismatches += predictors[t].mismatches;
+    }
+    unsigned int swapped = atomic_load(&registry->reloads);
+    unsigned int failed = atomic_load(&registry->failures);
+    registry_close(registry);
+
+    for (int v = 0; v < 2; v++) {
+        nn_free(versions[v]);
+        mat_free(expected[v]);
+    }
+    mat_free(input);
+    MatStats after = mat_stats();
+    long leaked = (long)(after.allocs - before.allocs) - (long)(after.frees - before.frees);
+
+    printf("Reloads: %d saved, %u swapped in, %u failed loads, %d missed\n", reloads, swapped, failed, missed);
+    printf("Predictions: %zu in %.2f s (%.0f/s) over %zu threads, version a %zu, version b %zu, mismatched %zu\n",
+           predictions, seconds, predictions / seconds, threads, matches[0], matches[1], mismatches);
+    printf("Matrices leaked: %ld\n", leaked);
+
+    unlink(path);
+    unlink(tmp_path);
+    rmdir(dir);
+    free(predictors);
+    free(handles);
+    return (mismatches || missed || leaked) ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+#include "nn.h"
+#include "optim.h"
+#include "eval.h"
+#include "sampler.h"
+#include <time.h>
+#include <sys/resource.h>
+
+// End to end benchmark on a synthetic dataset generated in process, no files needed
+// Trains like main.c does, then measures single image nn_predict latency and batched prediction throughput
+// Usage: bench_train [--arch 2352,128,10] [--act sigmoid|relu|leaky_relu|tanh] [--optim sgd|momentum|nesterov|rmsprop|adam]
+//                    [--lr RATE] [--batch N] [--samples N] [--epochs N] [--latency N] [--seed N] [--json FILE]
+
+
+#define MAX_LAYERS 16
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Peak resident set size in KiB
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static size_t parse_arch(const char *text, size_t *arch) {
+    size_t count = 0;
+    char *end;
+    while (*text && count < MAX_LAYERS) {
+        arch[count++] = strtoul(text, &end, 10);
+        if (*end != ',') break;
+        text = end + 1;
+    }
+    return count;
+}
+
+static int parse_name(const char *text, const char *(*name)(int), int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(text, name(i)) == 0) return i;
+    }
+    fprintf(stderr, "Unknown name %s\n", text);
+    exit(1);
+}
+
+static const char *act_name(int act) { return nn_activation_name(act); }
+static const char *opt_name(int kind) { return optim_name(kind); }
+
+int main(int argc, char *argv[]) {
+    size_t arch[MAX_LAYERS] = {2352, 128, 10};
+    size_t arch_count = 3;
+    Activation hidden_act = ACT_SIGMOID;
+    OptimKind optimizer_kind = OPTIM_SGD;
+    float learning_rate = 0.1f;
+    size_t batch_size = 1;
+    int samples = 2000;
+    int epochs = 3;
+    int latency_runs = 10000;
+    unsigned long seed = 1;
+    const char *json = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--arch") == 0) arch_count = parse_arch(argv[++i], arch);
+        else if (strcmp(argv[i], "--act") == 0) hidden_act = parse_name(argv[++i], act_name, ACT_SOFTMAX);
+        else if (strcmp(argv[i], "--optim") == 0) optimizer_kind = parse_name(argv[++i], opt_name, OPTIM_ADAM + 1);
+        else if (strcmp(argv[i], "--lr") == 0) learning_rate = strtof(argv[++i], NULL);
+        else if (strcmp(argv[i], "--batch") == 0) batch_size = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--samples") == 0) samples = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--epochs") == 0) epochs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--latency") == 0) latency_runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--json") == 0) json = argv[++i];
+        else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (arch_count < 2 || batch_size == 0 || samples <= 0 || latency_runs <= 0) {
+        fprintf(stderr, "Invalid configuration.\n");
+        return 1;
+    }
+
+    srand(seed);
+    int input_size = arch[0];
+    int num_classes = arch[arch_count - 1];
+    Dataset *dataset = dataset_synthetic(samples, input_size, num_classes);
+
+    NN nn = nn_alloc(arch, arch_count);
+    for (size_t l = 0; l + 1 < nn.size; l++) nn_set_activation(nn, l, hidden_act);
+    nn_rand(nn, -0.05f, 0.05f);
+    nn_specialize(&nn); // the kernel nn_load would pick for a saved model of this shape
+    NN gradient = nn_alloc_like(nn);
+    Optimizer optimizer = optim_alloc(nn, optimizer_kind, learning_rate);
+    Sampler sampler = sampler_alloc(dataset->count, 32, 8, seed);
+
+    printf("Architecture:");
+    for (size_t i = 0; i < arch_count; i++) printf(" %zu", arch[i]);
+    printf(", %s hidden, %s lr %g, batch %zu, %d samples\n",
+           nn_activation_name(hidden_act), optim_name(optimizer_kind), learning_rate, batch_size, samples);
+
+    // Training, the same per sample work as main.c
+    double *epoch_rates = malloc(epochs * sizeof(double));
+    assert(epoch_rates != NULL);
+    MatStats before = mat_stats();
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        double start = now();
+        float total_cost = 0.0f;
+        size_t in_batch = 0;
+
+        sampler_shuffle(sampler, epoch);
+        for (int k = 0; k < dataset->count; k++) {
+            size_t i = sampler.order[k];
+            Mat input = mat_view(dataset->images[i], 1, input_size, input_size);
+
+            total_cost += nn_train_sample(nn, gradient, input, dataset->labels[i]);
+            if (++in_batch == batch_size) {
+                optim_step(&optimizer, nn, gradient, in_batch);
+                in_batch = 0;
+            }
+        }
+        if (in_batch > 0) optim_step(&optimizer, nn, gradient, in_batch);
+
+        double elapsed = now() - start;
+        epoch_rates[epoch] = dataset->count / elapsed;
+        printf("Epoch %d/%d, Cost: %.4f, %.1f samples/s\n", epoch + 1, epochs, total_cost / dataset->count, epoch_rates[epoch]);
+    }
+    MatStats after = mat_stats();
+    double train_allocs = (double)(after.allocs - before.allocs) / ((double)epochs * dataset->count);
+    printf("Training allocations: %zu (%.2f per sample, %.1f bytes per sample)\n",
+           after.allocs - before.allocs, train_allocs,
+           (double)(after.bytes - before.bytes) / ((double)epochs * dataset->count));
+
+    // Single image latency through nn_predict
+    double *latencies = malloc(latency_runs * sizeof(double));
+    assert(latencies != NULL);
+    Mat input = mat_alloc(1, input_size);
+    before = mat_stats();
+    for (int r = 0; r < latency_runs; r++) {
+        memcpy(input.es, dataset->images[r % dataset->count], input_size * sizeof(float));
+        double start = now();
+        nn_predict(nn, input);
+        latencies[r] = (now() - start) * 1e9;
+    }
+    after = mat_stats();
+    mat_free(input);
+    qsort(latencies, latency_runs, sizeof(double), compare_double);
+    double p50 = latencies[latency_runs / 2];
+    double p99 = latencies[(size_t)(latency_runs * 0.99)];
+    double p999 = latencies[(size_t)(latency_runs * 0.999)];
+    printf("nn_predict latency: p50 %.0f ns, p99 %.0f ns, p999 %.0f ns, %zu allocations\n",
+           p50, p99, p999, after.allocs - before.allocs);
+
+    // Batched prediction throughput over the whole dataset
+    Mat inputs = mat_alloc(dataset->count, input_size);
+    for (int i = 0; i < dataset->count; i++) {
+        memcpy(&MAT_AT(inputs, i, 0), dataset->images[i], input_size * sizeof(float));
+    }
+    int *predicted = malloc(dataset->count * sizeof(int));
+    assert(predicted != NULL);
+    NN batch = nn_batch_alloc(nn, batch_size);
+    double start = now();
+    nn_predict_batch(batch, inputs, predicted);
+    double batch_rate = dataset->count / (now() - start);
+    nn_batch_free(batch);
+
+    // Evaluation spread over every CPU
+    start = now();
+    Evaluation eval = nn_evaluate(nn, dataset, 64, EVAL_THREADS_AUTO);
+    double eval_rate = dataset->count / (now() - start);
+    printf("Batched predict: %.1f samples/s at batch %zu, accuracy %.2f%%\n", batch_rate, batch_size, eval.accuracy);
+    printf("Evaluation: %.1f samples/s, cost %.4f\n", eval_rate, eval.cost);
+
+    long rss = peak_rss_kb();
+    printf("Peak RSS: %ld KiB\n", rss);
+
+    if (json) {
+        FILE *file = fopen(json, "w");
+        if (!file) {
+            fprintf(stderr, "Failed to open %s for writing.\n", json);
+            return 1;
+        }
+        fprintf(file, "{\n  \"arch\": [");
+        for (size_t i = 0; i < arch_count; i++) fprintf(file, "%s%zu", i ? ", " : "", arch[i]);
+        fprintf(file, "],\n  \"activation\": \"%s\",\n  \"optimizer\": \"%s\",\n  \"batch_size\": %zu,\n  \"samples\": %d,\n",
+                nn_activation_name(hidden_act), optim_name(optimizer_kind), batch_size, samples);
+        fprintf(file, "  \"epoch_samples_per_sec\": [");
+        for (int e = 0; e < epochs; e++) fprintf(file, "%s%.1f", e ? ", " : "", epoch_rates[e]);
+        fprintf(file, "],\n  \"train_allocs_per_sample\": %.3f,\n", train_allocs);
+        fprintf(file, "  \"latency_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f},\n", p50, p99, p999);
+        fprintf(file, "  \"batch_predict_samples_per_sec\": %.1f,\n  \"eval_samples_per_sec\": %.1f,\n", batch_rate, eval_rate);
+        fprintf(file, "  \"accuracy\": %.2f,\n  \"peak_rss_kb\": %ld\n}\n", eval.accuracy, rss);
+        fclose(file);
+        printf("Results written to %s\n", json);
+    }
+
+    eval_free(eval);
+    free(predicted);
+    mat_free(inputs);
+    free(latencies);
+    free(epoch_rates);
+    sampler_free(sampler);
+    optim_free(optimizer);
+    nn_free(gradient);
+    nn_free(nn);
+    dataset_free(dataset);
+    return 0;
+}
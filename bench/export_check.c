@@ -0,0 +1,51 @@
+#include "nn.h"
+#include "nn_model.h"
+
+// Check for nn_export, built by make export-check next to the nn_model.c it just generated
+// Runs nn_predict and nn_model_predict on the same random inputs, labels and every score must match
+// bit for bit. Exits 1 otherwise.
+// Usage: export_check [--model FILE] [--samples N] [--seed N]
+
+
+int main(int argc, char *argv[]) {
+    const char *model = "nn_configuration.txt";
+    int samples = 1000;
+    unsigned long seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) model = argv[++i];
+        else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) samples = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--model FILE] [--samples N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    NN nn;
+    if (nn_try_load(model, &nn) != 0) return 1;
+    if (nn.ws[0].rows != NN_MODEL_INPUTS || NN_OUTPUT(nn).cols != NN_MODEL_OUTPUTS) {
+        fprintf(stderr, "%s does not have the shape nn_model.c was generated for.\n", model);
+        return 1;
+    }
+
+    srand(seed);
+    Mat input = mat_alloc(1, NN_MODEL_INPUTS);
+    float scores[NN_MODEL_OUTPUTS];
+    int label_mismatches = 0, score_mismatches = 0;
+    for (int s = 0; s < samples; s++) {
+        for (size_t i = 0; i < NN_MODEL_INPUTS; i++) input.es[i] = rand_float();
+
+        int expected = nn_predict(nn, input);
+        int label = nn_model_predict(input.es, scores);
+        if (label != expected) label_mismatches++;
+        if (memcmp(scores, NN_OUTPUT(nn).es, sizeof(scores)) != 0) score_mismatches++;
+    }
+
+    printf("nn_export check on %s: %d samples, %d label and %d score mismatches\n",
+           model, samples, label_mismatches, score_mismatches);
+
+    mat_free(input);
+    nn_free(nn);
+    return label_mismatches || score_mismatches ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+#ifndef ALLREDUCE_H_
+#define ALLREDUCE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Peer addresses are "unix:PATH" or "tcp:HOST:PORT", one per rank
+#define RING_ADDR_MAX 256
+
+// Seconds ring_open waits for its neighbours to come up, and a transfer waits for a silent peer
+#define RING_CONNECT_TIMEOUT 30
+#define RING_IO_TIMEOUT 60
+
+// Segments shorter than this are always summed exactly, compressing them saves next to nothing
+#define RING_COMPRESS_MIN 4096
+
+// How ring_reduce and posted segments travel
+// RING_Q8 sends every chunk as one float scale and a signed byte per value, a quarter of the bytes
+// RING_TOPK sends only the largest magnitudes, topk_ratio of the values as index / value pairs
+// Both add what was dropped to a residual the caller keeps, it is sent with the next gradients
+typedef enum{
+    RING_EXACT,
+    RING_Q8,
+    RING_TOPK,
+}RingCompression;
+
+// One array handed to ring_post
+typedef struct{
+    float *data;
+    float *residual;
+    size_t count;
+}RingSegment;
+
+// world processes in a ring, each sends to rank + 1 and receives from rank - 1
+// ring_allreduce sums a float array over every rank in 2 * (world - 1) steps, each rank sending
+// 2 * (world - 1) / world of the array whatever the world size, and every rank ends with the same bits
+// Segments given to ring_post are summed by ring_reduce on a background thread, in post order, so the
+// gradients of one layer travel while backprop is still working on the layers before it
+typedef struct{
+    int rank;
+    int world;
+    int left;                       // connection from rank - 1
+    int right;                      // connection to rank + 1
+    float *chunk;                   // receives one chunk of the reduce-scatter before it is added
+    size_t chunk_count;
+    uint64_t bytes_sent;
+    double busy_seconds;            // time spent summing arrays, posted or not
+
+    RingCompression compression;
+    float topk_ratio;
+    unsigned char *packed;          // compressed form of the array being summed
+    size_t packed_size;
+    float *magnitudes;              // top-k selection scratch
+    size_t magnitudes_count;
+
+    RingSegment *pending;           // posted segments, pending[done..count) are not summed yet
+    size_t pending_count;
+    size_t pending_done;
+    size_t pending_capacity;
+    int failed;
+    int stop;
+    pthread_t thread;
+    int thread_started;             // 1 running, -1 failed to start and posts reduce inline, 0 not yet
+    pthread_mutex_t lock;
+    pthread_cond_t posted;
+    pthread_cond_t drained;
+}Ring;
+
+
+Ring *ring_open(const char **peers, int world, int rank);
+
+int ring_allreduce(Ring *ring, float *data, size_t count);
+
+int ring_broadcast(Ring *ring, float *data, size_t count);
+
+void ring_compress(Ring *ring, RingCompression compression, float topk_ratio);
+
+const char *ring_compression_name(RingCompression compression);
+
+int ring_reduce(Ring *ring, float *data, float *residual, size_t count);
+
+void ring_post(Ring *ring, float *data, float *residual, size_t count);
+
+int ring_wait(Ring *ring);
+
+void ring_close(Ring *ring);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "nn.h"
+#include <pthread.h>
+
+// Periodic checkpoints written by a background thread
+// checkpoint_step copies the weights into a snapshot and returns, the writer thread saves the
+// snapshot with nn_save (temp file, fsync, rename) while training goes on. If the previous
+// checkpoint is still being written the new one is skipped rather than waiting for the disk.
+
+typedef struct{
+    unsigned long written;
+    unsigned long skipped; // writer still busy when a checkpoint was due
+    unsigned long failed;
+}CheckpointStats;
+
+typedef struct{
+    NN snapshot;
+    char path[1024];
+    unsigned long every;   // optimizer steps between checkpoints
+    unsigned long step;    // step of the snapshot
+    CheckpointStats stats;
+    int pending;           // snapshot taken and not written yet
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}Checkpointer;
+
+
+Checkpointer *checkpoint_open(NN nn, const char *path, unsigned long every);
+
+int checkpoint_step(Checkpointer *checkpointer, NN nn, unsigned long step);
+
+CheckpointStats checkpoint_close(Checkpointer *checkpointer);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef EVAL_H_
+#define EVAL_H_
+#include "nn.h"
+#include "image.h"
+#include "loader.h"
+
+// nn_evaluate threads, one per online CPU
+#define EVAL_THREADS_AUTO 0
+
+typedef struct{
+    int count;
+    int correct;
+    float accuracy; // percent
+    float cost;     // average cross-entropy
+    int num_classes;
+    int *confusion; // num_classes x num_classes counts, row is the true label and column the prediction
+}Evaluation;
+
+
+Evaluation nn_evaluate(NN nn, Dataset *dataset, size_t batch_size, size_t threads);
+
+Evaluation nn_evaluate_loader(NN nn, Loader *loader);
+
+float eval_class_accuracy(Evaluation eval, int label);
+
+void eval_print(Evaluation eval, FILE *out);
+
+void eval_free(Evaluation eval);
+
+#endif
@@ -30,12 +30,28 @@ int count_images_in_directory(const char *dir_name);
 
 float *load_image(const char *filename, int *width, int *height, int *channels);
 
+float *load_image_from_memory(const unsigned char *data, int size, int *width, int *height);
+
 float **process_directory(const char *dir_name, int *count, int **image_sizes);
 
 void print_images_data(float **images, int *image_sizes, int count);
 
 int get_class_label(const char *class_name, char class_names[][256], int *num_classes);
 
+int list_directory_with_labels(const char *dir_name, char ***paths, int **labels, int *num_classes);
+
+int load_image_into(const char *filename, float *dst, int size);
+
 Dataset* process_directory_with_labels(const char *dir_name);
 
+Dataset* process_directory_shard(const char *dir_name, int rank, int world);
+
+Dataset* dataset_split(Dataset *dataset, float fraction);
+
+void dataset_shard(Dataset *dataset, int rank, int world);
+
+Dataset* dataset_synthetic(int count, int input_size, int num_classes);
+
+void dataset_free(Dataset *dataset);
+
 #endif
@@ -0,0 +1,55 @@
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <assert.h>
+#include "sampler.h"
+
+// One decoded mini-batch, images are stored row after row so they can be used as a count x image_size Mat
+typedef struct{
+    float *images;
+    int *labels;
+    size_t count;  // images decoded into this batch, can be less than batch_size at the end of an epoch
+    size_t epoch;
+    int last;      // last batch of its epoch
+}Batch;
+
+// Streams a dataset directory, a background thread decodes the next batches into a ring of
+// preallocated buffers while the current batch is being used, only the file list is kept in memory
+// Files are read in the block shuffled order of the sampler, reshuffled every epoch
+typedef struct{
+    char **paths;
+    int *labels;
+    int count;
+    Sampler sampler; // only touched by the loader thread
+    int num_classes;
+    int image_size;
+    size_t batch_size;
+
+    Batch *ring;
+    size_t ring_size;
+    size_t head;    // next slot the thread fills
+    size_t tail;    // next slot handed to the consumer
+    size_t filled;  // slots decoded and not released yet
+    int stop;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+}Loader;
+
+
+Loader* loader_open(const char *dir_name, size_t batch_size, size_t ring_size,
+                    size_t shuffle_block, size_t shuffle_window, uint64_t seed);
+
+Batch* loader_next(Loader *loader);
+
+void loader_release(Loader *loader, Batch *batch);
+
+size_t loader_queue_depth(Loader *loader);
+
+void loader_close(Loader *loader);
+
+#endif
@@ -11,6 +11,17 @@
 
 #define MAT_AT(m, row, col) (m.es[(row) * (m.stride) + (col)])
 
+// make release defines MAT_CLONES, the SIMD kernels are then also compiled for AVX2 and the dynamic
+// loader picks the clone for the running CPU. AVX2 without FMA keeps every result bit-identical
+#if defined(MAT_CLONES) && defined(__x86_64__)
+#define MAT_SIMD __attribute__((target_clones("avx2", "default")))
+#else
+#define MAT_SIMD
+#endif
+
+// Slope of leaky relu for negative inputs
+#define LEAKY_RELU_ALPHA 0.01f
+
 
 typedef struct{
     size_t rows;
@@ -19,13 +30,61 @@ typedef struct{
     float *es;
 }Mat;
 
+typedef struct{
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+}MatStats;
+
+// Bump allocator for per step temporaries, everything pushed after a mark is dropped at once by
+// arena_reset. Allocations past the capacity spill to the heap and the region grows to the peak
+// on the next full reset, so a loop doing the same work every step stops calling malloc after the first.
+typedef struct{
+    char *base;
+    size_t capacity;
+    size_t used;
+    size_t peak;        // most bytes in use at once, region and spills
+    void *spills;       // heap blocks taken once the region was full, newest first
+    size_t spill_count;
+    size_t spill_bytes;
+}Arena;
+
+typedef struct{
+    size_t used;
+    size_t spill_count;
+}ArenaMark;
+
 
 float rand_float(void);
 
 Mat mat_alloc(size_t rows, size_t cols);
 
+MatStats mat_stats(void);
+
+Arena arena_alloc(size_t capacity);
+
+void arena_free(Arena *arena);
+
+void *arena_push(Arena *arena, size_t bytes);
+
+ArenaMark arena_mark(Arena *arena);
+
+void arena_reset(Arena *arena, ArenaMark mark);
+
+Arena *mat_scratch(void);
+
+Mat mat_alloc_in(Arena *arena, size_t rows, size_t cols);
+
 void mat_rand(Mat m, float low, float high);
 
+Mat mat_view(float *es, size_t rows, size_t cols, size_t stride);
+
+Mat mat_sub(Mat m, size_t row, size_t col, size_t rows, size_t cols);
+
+Mat mat_rows(Mat m, size_t start, size_t count);
+
+Mat mat_cols(Mat m, size_t start, size_t count);
+
 Mat mat_row(Mat m, size_t row);
 
 void mat_copy(Mat dst, Mat src);
@@ -34,6 +93,8 @@ void mat_dot(Mat dst, Mat a, Mat b);
 
 void mat_sum(Mat dst, Mat a);
 
+void mat_sum_row(Mat dst, Mat row);
+
 void mat_scale(Mat dst, float a);
 
 void mat_subtract(Mat dst, Mat a);
@@ -48,6 +109,8 @@ void mat_sig(Mat m);
 
 void mat_dsig(Mat m);
 
+void mat_softmax(Mat m);
+
 void mat_free(Mat m);
 
 Mat* array_to_mat(float **images, int *image_sizes, int count);
@@ -64,5 +127,17 @@ void mat_relu(Mat m);
 
 void mat_drelu(Mat m);
 
+void mat_leaky_relu(Mat m);
+
+void mat_tanh(Mat m);
+
+void mat_sig_grad(Mat delta, Mat a);
+
+void mat_relu_grad(Mat delta, Mat a);
+
+void mat_leaky_relu_grad(Mat delta, Mat a);
+
+void mat_tanh_grad(Mat delta, Mat a);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Process wide registry of metrics exposed in the Prometheus text format
+// Metrics are registered once, updated from any thread, and either written to a file
+// (for the node exporter textfile collector) or served over HTTP on localhost
+
+#define METRICS_MAX 64
+
+// Seconds the /metrics endpoint waits on a silent client
+#define METRICS_CLIENT_TIMEOUT 2
+
+typedef enum{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+}MetricType;
+
+
+int metrics_register(const char *name, const char *help, MetricType type, const char *labels);
+
+void metrics_set(int id, double value);
+
+void metrics_add(int id, double value);
+
+void metrics_write(FILE *out);
+
+int metrics_write_file(const char *filename);
+
+int metrics_serve(int port);
+
+void metrics_stop(void);
+
+#endif
@@ -1,39 +1,115 @@
 #ifndef NN_H_
 #define NN_H_
 #include "matrix.h"
+#include "prof.h"
 
-#define NN_OUTPUT(nn) (nn).as[(nn).count]
+#define NN_OUTPUT(nn) (nn).as[(nn).size]
+
+// Smallest probability fed to logf in the cross-entropy
+#define NN_LOG_EPS 1e-7f
+
+// Parameter blocks start on a 64 bytes boundary of the slab, in floats
+#define NN_PARAM_ALIGN 16
+
+// First word of a saved model that carries activation ids, older files start with the layer count
+#define NN_FILE_MAGIC 0x314E4E43u
+
+// Every activation as X(id, name, forward kernel, gradient kernel)
+// Softmax has no gradient kernel, it is only valid on the output layer where it fuses with the cross-entropy
+#define NN_ACTIVATIONS(X) \
+    X(ACT_SIGMOID,    "sigmoid",    mat_sig,        mat_sig_grad)        \
+    X(ACT_RELU,       "relu",       mat_relu,       mat_relu_grad)       \
+    X(ACT_LEAKY_RELU, "leaky_relu", mat_leaky_relu, mat_leaky_relu_grad) \
+    X(ACT_TANH,       "tanh",       mat_tanh,       mat_tanh_grad)       \
+    X(ACT_SOFTMAX,    "softmax",    mat_softmax,    NULL)
+
+// Architectures with a forward pass specialized at compile time, as X(input, hidden, output)
+// nn_load picks the matching one, every other shape runs the generic mat_dot loops
+#define NN_FIXED_SHAPES(X) \
+    X(2352, 128, 10) \
+    X(784,  128, 10)
+
+#define NN_ACT_ENUM(id, name, fwd, grad) id,
+typedef enum{
+    NN_ACTIVATIONS(NN_ACT_ENUM)
+    ACT_COUNT
+}Activation;
+#undef NN_ACT_ENUM
 
 typedef struct{
     size_t size;
     Mat *ws;
     Mat *bs;
     Mat *as;
+    Activation *acts; // acts[i] is applied to as[i+1]
+    float *params;      // one aligned slab behind every ws[i] and bs[i], see nn_params
+    size_t param_count; // floats in the slab, padding included
+    unsigned kernel;    // 1 + index in NN_FIXED_SHAPES of the specialized forward pass, 0 for the generic one
 }NN;
 
 
+// Called during backprop as soon as the gradients of a layer are final, last layer first
+typedef void (*NNLayerHook)(void *ctx, size_t layer);
+
+
 NN nn_alloc(size_t *arch, size_t arch_count);
 
+Mat nn_params(NN nn);
+
+Mat nn_layer_params(NN nn, size_t layer);
+
+NN nn_alloc_like(NN nn);
+
+NN nn_batch_alloc(NN nn, size_t batch_size);
+
+NN nn_batch_alloc_in(Arena *arena, NN nn, size_t batch_size);
+
+void nn_batch_free(NN batch);
+
+void nn_batch_rows(NN batch, size_t rows);
+
+void nn_copy(NN dst, NN src);
+
 void nn_print();
 
 void nn_rand(NN nn, float low, float high);
 
-void nn_learn();
+void nn_set_activation(NN nn, size_t layer, Activation act);
 
-void nn_forward(NN nn);
+const char *nn_activation_name(Activation act);
 
-void nn_learn();
+void nn_specialize(NN *nn);
+
+void nn_forward(NN nn);
 
 float nn_cost(NN nn, Mat training_input, Mat training_output);
 
-void nn_backprop(NN nn, Mat training_input, Mat training_output, float learning_rate);
+float nn_cross_entropy(NN nn, int label);
+
+void nn_backprop(NN nn, NN g, Mat training_input, Mat training_output);
+
+void nn_backprop_label(NN nn, NN g, int label);
+
+void nn_zero(NN nn);
+
+float nn_train_sample(NN nn, NN g, Mat input, int label);
+
+float nn_train_sample_hook(NN nn, NN g, Mat input, int label, NNLayerHook hook, void *ctx);
+
+Mat nn_set_input(NN nn, Mat input);
 
 void nn_free(NN nn);
 
-void nn_save(NN nn, const char *filename);
+int nn_save(NN nn, const char *filename);
 
 NN nn_load(const char *filename);
 
+int nn_try_load(const char *filename, NN *out);
+
 int nn_predict(NN nn, Mat input);
 
+int nn_argmax(NN nn, size_t row);
+
+void nn_predict_batch(NN batch, Mat inputs, int *predicted);
+
 #endif
\ No newline at end of file
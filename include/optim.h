@@ -0,0 +1,34 @@
+#ifndef OPTIM_H_
+#define OPTIM_H_
+#include "nn.h"
+
+typedef enum{
+    OPTIM_SGD,
+    OPTIM_MOMENTUM,
+    OPTIM_NESTEROV,
+    OPTIM_RMSPROP,
+    OPTIM_ADAM,
+}OptimKind;
+
+// Optimizer state lives in networks shaped like the one being trained, allocated once
+typedef struct{
+    OptimKind kind;
+    float learning_rate;
+    float beta1;   // momentum, or decay of the first moment for adam
+    float beta2;   // decay of the squared gradient average for rmsprop and adam
+    float eps;
+    size_t t;      // number of steps taken, for adam bias correction
+    NN m;          // velocity / first moment
+    NN v;          // squared gradient average / second moment
+}Optimizer;
+
+
+Optimizer optim_alloc(NN nn, OptimKind kind, float learning_rate);
+
+void optim_step(Optimizer *opt, NN nn, NN g, size_t batch_size);
+
+void optim_free(Optimizer opt);
+
+const char *optim_name(OptimKind kind);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef PROF_H_
+#define PROF_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Hot path phase timers, compiled in with -DPROF (make PROF=1) and removed entirely otherwise
+// Usage: PROF_BEGIN(t); ...; PROF_END(t, PROF_FORWARD);
+// Times are accumulated per slot and printed per epoch by PROF_EPOCH_REPORT
+
+#define PROF_MAX_LAYERS 16
+
+typedef enum{
+    PROF_EPOCH,     // whole epoch, the reference for percentages
+    PROF_FORWARD,
+    PROF_COST,
+    PROF_BACKPROP,
+    PROF_OPTIM,
+    PROF_PHASE_COUNT,
+}ProfPhase;
+
+// Slots of the per layer timers, after the phases
+// Deeper layers share the last slot
+#define PROF_LAYER_CLAMP(l)    ((l) < PROF_MAX_LAYERS ? (int)(l) : PROF_MAX_LAYERS - 1)
+#define PROF_LAYER_FORWARD(l)  (PROF_PHASE_COUNT + PROF_LAYER_CLAMP(l))
+#define PROF_LAYER_BACKWARD(l) (PROF_PHASE_COUNT + PROF_MAX_LAYERS + PROF_LAYER_CLAMP(l))
+#define PROF_SLOT_COUNT        (PROF_PHASE_COUNT + 2 * PROF_MAX_LAYERS)
+
+// Cheapest timestamp available, cycles on x86 and nanoseconds elsewhere
+static inline uint64_t prof_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void prof_add(int slot, uint64_t ticks);
+
+void prof_epoch_report(FILE *out);
+
+void prof_reset(void);
+
+double prof_seconds(int slot);
+
+// Chrome trace / Perfetto JSON export, events are written only after prof_trace_open
+// nn_forward and backprop calls are traced one in sample_rate, per layer events only inside traced calls
+
+int prof_trace_open(const char *filename, unsigned sample_rate);
+
+void prof_trace_close(void);
+
+int prof_trace_enabled(void);
+
+int prof_trace_sample(atomic_uint *counter);
+
+uint64_t prof_trace_ts(void);
+
+void prof_trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, int layer);
+
+void prof_trace_thread_name(const char *name);
+
+#ifdef PROF
+#define PROF_BEGIN(var) uint64_t var = prof_now()
+#define PROF_END(var, slot) prof_add((slot), prof_now() - (var))
+#define PROF_EPOCH_REPORT(out) prof_epoch_report(out)
+#define PROF_RESET() prof_reset()
+#define PROF_TRACE_SAMPLE(var) static atomic_uint var##_counter; int var = prof_trace_sample(&var##_counter)
+#define PROF_TRACE_BEGIN(var, cond) uint64_t var = (cond) ? prof_trace_ts() : 0
+#define PROF_TRACE_END(var, name, layer) do { if (var) prof_trace_event((name), (var), prof_trace_ts(), (layer)); } while (0)
+#else
+#define PROF_BEGIN(var) ((void)0)
+#define PROF_END(var, slot) ((void)0)
+#define PROF_EPOCH_REPORT(out) ((void)0)
+#define PROF_RESET() ((void)0)
+#define PROF_TRACE_SAMPLE(var) ((void)0)
+#define PROF_TRACE_BEGIN(var, cond) ((void)0)
+#define PROF_TRACE_END(var, name, layer) ((void)0)
+#endif
+
+#endif
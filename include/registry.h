@@ -0,0 +1,44 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include "nn.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Model registry for long running processes serving a network saved with nn_save
+// The model file is watched with inotify and every new version is loaded in the background,
+// then swapped in. Readers pin the version they use with registry_acquire / registry_release,
+// the old weights are freed once the last prediction running on them releases it (RCU style).
+
+typedef struct{
+    NN nn;
+    unsigned int version;
+    atomic_uint refs;   // one for the registry while current, one per reader
+}Model;
+
+typedef struct{
+    char path[1024];
+    Model *current;
+    unsigned int version;
+    atomic_uint reloads;  // versions swapped in after the first
+    atomic_uint failures; // versions that failed to load or changed the architecture
+    pthread_mutex_t lock; // guards current between reading the pointer and taking the reference
+    pthread_t watcher;
+    int inotify_fd;
+    int stop_fd[2];
+}Registry;
+
+
+Registry *registry_open(const char *path);
+
+void registry_close(Registry *registry);
+
+Model *registry_acquire(Registry *registry);
+
+void registry_release(Model *model);
+
+int registry_reload(Registry *registry);
+
+NN model_bind(Model *model, NN batch);
+
+#endif
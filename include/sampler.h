@@ -0,0 +1,28 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// Seeded per-epoch permutation of sample indices
+// Block shuffle: indices are cut into contiguous blocks of block_size, the block order is shuffled,
+// then samples are shuffled within windows of `window` consecutive blocks. Every batch mixes samples
+// from several random blocks while memory is only touched one window at a time.
+// block_size <= 1 is a plain Fisher-Yates shuffle of everything.
+typedef struct{
+    size_t *order;  // order[k] is the k-th sample of the current epoch
+    size_t count;
+    size_t block_size;
+    size_t window;  // blocks shuffled together
+    uint64_t seed;
+}Sampler;
+
+
+Sampler sampler_alloc(size_t count, size_t block_size, size_t window, uint64_t seed);
+
+void sampler_shuffle(Sampler sampler, size_t epoch);
+
+void sampler_free(Sampler sampler);
+
+#endif
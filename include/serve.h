@@ -0,0 +1,67 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Wire format of the inference daemon (tools/nn_server.c) on its Unix domain socket
+// A client sends a ServeRequest followed by `size` payload bytes and gets back a ServeResponse
+// followed by num_classes float scores. Requests on one connection are answered in order.
+// A SERVE_SHM request attaches a shared memory ring instead, its response carries no scores.
+
+#define SERVE_MAGIC 0x4E4E5351u // "QSNN"
+#define SERVE_DEFAULT_SOCKET "/tmp/nn_server.sock"
+
+typedef enum{
+    SERVE_TENSOR = 1, // payload is the preprocessed float input, input_size floats
+    SERVE_IMAGE  = 2, // payload is an encoded image file (jpg, png, ppm...) decoded by the server
+    SERVE_SHM    = 3, // payload is the name of a shm_ring.h ring, served until the connection closes
+}ServeKind;
+
+typedef enum{
+    SERVE_OK = 0,
+    SERVE_BAD_REQUEST = 1, // bad magic, kind or size
+    SERVE_BAD_IMAGE = 2,   // image couldn't be decoded or has the wrong size
+    SERVE_BAD_RING = 3,    // ring couldn't be opened, doesn't match the model or has no worker
+    SERVE_SHUTDOWN = 4,    // the server is stopping, the request wasn't run
+}ServeStatus;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t size;  // payload bytes
+    uint32_t id;    // echoed in the response
+}ServeRequest;
+
+typedef struct{
+    uint32_t id;
+    uint32_t status;
+    int32_t label;  // -1 unless status is SERVE_OK
+    uint32_t num_classes; // scores following the response
+}ServeResponse;
+
+// Latency histogram with power of two buckets, bucket i counts latencies in [2^i, 2^(i+1)) ns
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    double sum;
+}Histogram;
+
+
+int serve_read_full(int fd, void *buf, size_t size);
+
+int serve_write_full(int fd, const void *buf, size_t size);
+
+void histogram_add(Histogram *h, uint64_t ns);
+
+void histogram_merge(Histogram *dst, const Histogram *src);
+
+uint64_t histogram_percentile(const Histogram *h, double p);
+
+void histogram_print(const Histogram *h, FILE *out, const char *title);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Shared memory request ring between one producer process and the inference workers of nn_server
+// The producer writes an input tensor straight into a slot and publishes it, a worker claims the
+// slot and runs nn_forward with nn.as[0] pointing at the slot input and the output at the slot scores.
+// Claiming is lock free, sleeping on an empty ring or an unfinished slot goes through futex.
+
+#define SHM_RING_MAGIC 0x474E5252u // "RRNG"
+#define SHM_RING_SPIN 2000         // polls before falling back to futex_wait, only with more than one cpu
+
+typedef enum{
+    SHM_SLOT_FREE = 0,    // owned by the producer
+    SHM_SLOT_REQUEST = 1, // published, waiting for or claimed by a worker
+    SHM_SLOT_DONE = 2,    // label and scores are written
+}ShmSlotState;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t slots;       // a power of two
+    uint32_t input_size;
+    uint32_t num_classes;
+    uint32_t slot_bytes;
+    _Alignas(64) atomic_uint head; // requests published, only the producer writes it
+    atomic_uint sleepers;          // workers in futex_wait on head
+    _Alignas(64) atomic_uint tail; // requests claimed by workers
+    _Alignas(64) atomic_uint stop;
+}ShmRingHeader;
+
+// Slot header, the input floats start at the next 64 bytes boundary followed by the scores
+typedef struct{
+    _Alignas(64) atomic_uint state;
+    atomic_uint sleeping; // the producer is in futex_wait on state
+    uint32_t id;
+    int32_t label;
+}ShmSlot;
+
+// The sizes are copied out of the header once they are checked, the other process can still write the header
+typedef struct{
+    ShmRingHeader *header;
+    size_t size;     // mapped bytes
+    uint32_t slots;
+    uint32_t input_size;
+    uint32_t num_classes;
+    size_t slot_bytes;
+    size_t scores_offset; // from the start of a slot
+    uint32_t next;   // producer: next slot to acquire
+    int spin;        // polls before sleeping
+    int owner;       // created the segment, unlinks it on close
+    char name[64];
+}ShmRing;
+
+
+ShmRing *shm_ring_create(const char *name, uint32_t slots, uint32_t input_size, uint32_t num_classes);
+
+ShmRing *shm_ring_open(const char *name);
+
+void shm_ring_close(ShmRing *ring);
+
+ShmSlot *shm_ring_slot(ShmRing *ring, uint32_t slot);
+
+float *shm_ring_input(ShmRing *ring, uint32_t slot);
+
+float *shm_ring_scores(ShmRing *ring, uint32_t slot);
+
+// Producer side
+uint32_t shm_ring_acquire(ShmRing *ring);
+
+void shm_ring_publish(ShmRing *ring, uint32_t slot, uint32_t id);
+
+int shm_ring_wait(ShmRing *ring, uint32_t slot);
+
+void shm_ring_release(ShmRing *ring, uint32_t slot);
+
+void shm_ring_stop(ShmRing *ring);
+
+// Worker side
+int shm_ring_claim(ShmRing *ring);
+
+void shm_ring_complete(ShmRing *ring, uint32_t slot, int label);
+
+#endif
@@ -1,33 +1,177 @@
 
 #include "include/nn.h"
+#include "include/optim.h"
+#include "include/eval.h"
 #include "include/matrix.h"
 #include "include/image.h"
+#include "include/loader.h"
+#include "include/sampler.h"
+#include "include/prof.h"
+#include "include/metrics.h"
+#include "include/checkpoint.h"
 #include <time.h>
 
 // The training process is too slow I'm not even sure if this is working properly
 
 
+// Ids of everything main.c exports through metrics.h
+typedef struct{
+    int samples_per_second;
+    int epoch;
+    int epoch_cost;
+    int validation_cost;
+    int validation_accuracy;
+    int samples;
+    int mat_allocs;
+    int mat_bytes;
+    int queue_depth;
+    int layer_forward[PROF_MAX_LAYERS];
+    int layer_backward[PROF_MAX_LAYERS];
+}TrainingMetrics;
+
+static TrainingMetrics register_metrics(size_t layers) {
+    TrainingMetrics m;
+    m.samples_per_second = metrics_register("nn_training_samples_per_second", "Training throughput of the last epoch", METRIC_GAUGE, NULL);
+    m.epoch = metrics_register("nn_training_epoch", "Last completed epoch", METRIC_GAUGE, NULL);
+    m.epoch_cost = metrics_register("nn_training_cost", "Average cross-entropy of the last epoch", METRIC_GAUGE, NULL);
+    m.validation_cost = metrics_register("nn_validation_cost", "Average cross-entropy on the validation set", METRIC_GAUGE, NULL);
+    m.validation_accuracy = metrics_register("nn_validation_accuracy", "Validation accuracy in percent", METRIC_GAUGE, NULL);
+    m.samples = metrics_register("nn_training_samples_total", "Samples trained on", METRIC_COUNTER, NULL);
+    m.mat_allocs = metrics_register("nn_mat_allocations_total", "Matrices allocated by mat_alloc", METRIC_COUNTER, NULL);
+    m.mat_bytes = metrics_register("nn_mat_allocated_bytes_total", "Bytes allocated by mat_alloc", METRIC_COUNTER, NULL);
+    m.queue_depth = metrics_register("nn_loader_queue_depth", "Decoded batches waiting in the streaming loader", METRIC_GAUGE, NULL);
+
+    // Per layer times only exist in make PROF=1 builds
+    for (size_t l = 0; l < PROF_MAX_LAYERS; l++) m.layer_forward[l] = m.layer_backward[l] = -1;
+#ifdef PROF
+    char labels[32];
+    for (size_t l = 0; l < layers && l < PROF_MAX_LAYERS; l++) {
+        snprintf(labels, sizeof(labels), "layer=\"%zu\"", l);
+        m.layer_forward[l] = metrics_register("nn_layer_forward_seconds", "Forward time of a layer in the last epoch", METRIC_GAUGE, labels);
+    }
+    for (size_t l = 0; l < layers && l < PROF_MAX_LAYERS; l++) {
+        snprintf(labels, sizeof(labels), "layer=\"%zu\"", l);
+        m.layer_backward[l] = metrics_register("nn_layer_backward_seconds", "Backward time of a layer in the last epoch", METRIC_GAUGE, labels);
+    }
+#else
+    (void)layers;
+#endif
+    return m;
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Forward and backward pass for one image, returns its cost and accumulates the gradient
+// The network reads the image where it is stored, nothing is copied before the first layer
+static float train_sample(NN nn, NN gradient, float *image, int image_size, int label) {
+    Mat input = mat_view(image, 1, image_size, image_size);
+    return nn_train_sample(nn, gradient, input, label);
+}
+
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Usage: %s <dataset_directory>\n", argv[0]);
+        printf("Usage: %s <dataset_directory> [--stream] [--seed N] [--trace FILE] [--metrics FILE] [--metrics-port N] [--checkpoint-every N] [--checkpoint FILE] [--eval-threads N]\n", argv[0]);
         return 1;
     }
 
-    srand(time(NULL));
+    // --stream decodes batches on a background thread instead of loading the whole dataset first
+    // --seed makes the initialization and the sample order of every epoch reproducible
+    // --trace writes a Chrome trace / Perfetto timeline, needs a make PROF=1 build
+    // --metrics rewrites a Prometheus text file every epoch, --metrics-port serves it on 127.0.0.1
+    // --checkpoint-every saves the weights every N optimizer steps from a background thread
+    // --eval-threads splits evaluation over N threads, one per CPU by default
+    int stream = 0;
+    const char *metrics_file = NULL;
+    int metrics_port = 0;
+    unsigned long checkpoint_every = 0;
+    const char *checkpoint_file = "nn_checkpoint.txt";
+    size_t eval_threads = EVAL_THREADS_AUTO;
+    unsigned long seed = time(NULL);
+    const char *trace = NULL;
+    unsigned trace_sample_rate = 100; // Trace one nn_forward / backprop call in this many
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_every = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_file = argv[++i];
+        } else if (strcmp(argv[i], "--eval-threads") == 0 && i + 1 < argc) {
+            eval_threads = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    size_t stream_batch_size = 64; // Images per decoded batch
+    size_t stream_ring_size = 4;   // Decoded batches buffered ahead of training
+
+    // Samples are visited in a block shuffled order, blocks of shuffle_block consecutive
+    // samples mixed shuffle_window blocks at a time, see sampler.h
+    size_t shuffle_block = 32;
+    size_t shuffle_window = 8;
+
+    printf("Seed: %lu\n", seed);
+    srand(seed);
+
+    if (trace != NULL) {
+#ifndef PROF
+        fprintf(stderr, "Tracing is compiled out, rebuild with make PROF=1.\n");
+#endif
+        if (prof_trace_open(trace, trace_sample_rate) != 0) return 1;
+        prof_trace_thread_name("main");
+    }
+
+    Dataset *dataset = NULL;
+    Dataset *validation = NULL;
+    Loader *loader = NULL;
+    size_t input_size;
+    size_t num_classes;
+
+    if (stream) {
+        loader = loader_open(argv[1], stream_batch_size, stream_ring_size, shuffle_block, shuffle_window, seed);
+        if (loader == NULL) {
+            fprintf(stderr, "No images found or failed to load images.\n");
+            return 1;
+        }
+        printf("Streaming %d images across %d classes.\n", loader->count, loader->num_classes);
+        input_size = loader->image_size;
+        num_classes = loader->num_classes;
+    } else {
+        // Process the dataset
+        dataset = process_directory_with_labels(argv[1]);
+        if (dataset == NULL || dataset->count == 0) {
+            fprintf(stderr, "No images found or failed to load images.\n");
+            return 1;
+        }
+        printf("Loaded %d images across %d classes.\n", dataset->count, dataset->num_classes);
 
-    // Process the dataset
-    Dataset *dataset = process_directory_with_labels(argv[1]);
-    if (dataset == NULL || dataset->count == 0) {
-        fprintf(stderr, "No images found or failed to load images.\n");
-        return 1;
+        // Hold out part of the images to decide when to stop training
+        float validation_fraction = 0.1f;
+        validation = dataset_split(dataset, validation_fraction);
+        if (validation != NULL) {
+            printf("Holding out %d images for validation.\n", validation->count);
+        }
+        input_size = dataset->image_sizes[0];
+        num_classes = dataset->num_classes;
     }
-    printf("Loaded %d images across %d classes.\n", dataset->count, dataset->num_classes);
     
     
     // Define network architecture
-    size_t input_size = dataset->image_sizes[0]; // Number of input neurons
     size_t hidden_size = 128; // Hidden layer size
-    size_t num_classes = dataset->num_classes;
 
     size_t architecture[] = {input_size, hidden_size, num_classes};
     size_t architecture_count = sizeof(architecture) / sizeof(architecture[0]);
@@ -37,99 +181,198 @@ int main(int argc, char *argv[]) {
     printf("Neural network loaded!\n");
 
     //NN neural_network = nn_alloc(architecture, architecture_count);
+    //nn_set_activation(neural_network, 0, ACT_RELU); // ReLU hidden layer, sigmoid by default
     //nn_rand(neural_network, -0.5f, 0.5f); // Initialize weights and biases randomly
     //printf("Neural network initialized!\n");
 
+    for (size_t l = 0; l < neural_network.size; l++) {
+        printf("Layer %zu: %zu -> %zu (%s)\n", l, neural_network.ws[l].rows, neural_network.ws[l].cols,
+               nn_activation_name(neural_network.acts[l]));
+    }
+
     // Training parameters
     int epochs = 100;
     float learning_rate = 0.1f;
+    size_t batch_size = 1; // Samples whose gradients are averaged before each update
+    OptimKind optimizer_kind = OPTIM_SGD; // OPTIM_ADAM with ~0.001 for a freshly initialized network
+
+    // Gradient accumulator and optimizer state, allocated once
+    NN gradient = nn_alloc_like(neural_network);
+    Optimizer optimizer = optim_alloc(neural_network, optimizer_kind, learning_rate);
+    printf("Optimizer: %s, learning rate %g, batch size %zu\n", optim_name(optimizer.kind), learning_rate, batch_size);
+
+    // Per epoch order of the in memory dataset
+    Sampler sampler = sampler_alloc(stream ? 0 : dataset->count, shuffle_block, shuffle_window, seed);
+
+    // Early stopping, validate every eval_every epochs and stop after patience checks without improvement
+    int eval_every = 1;
+    int patience = 5;
+    size_t eval_batch_size = 64;
+    float best_cost = INFINITY;
+    int best_epoch = 0;
+    int checks_without_improvement = 0;
+    NN best_network = nn_alloc_like(neural_network); // Best weights seen so far on the validation set
+    nn_copy(best_network, neural_network);
+
+    // Periodic checkpoints only cost the training loop a copy of the weights
+    Checkpointer *checkpointer = checkpoint_open(neural_network, checkpoint_file, checkpoint_every);
+
+    TrainingMetrics metric_ids = register_metrics(neural_network.size);
+    if (metrics_port > 0 && metrics_serve(metrics_port) == 0) {
+        printf("Serving metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+    }
 
     // Training loop
     for (int epoch = 0; epoch < epochs; epoch++) {
+        double epoch_start = wall_seconds();
+        PROF_RESET(); // Leaves out the validation of the previous epoch
+        PROF_BEGIN(t_epoch);
+        PROF_TRACE_BEGIN(tr_epoch, prof_trace_enabled());
         float total_cost = 0.0f;
-        
-        for (int i = 0; i < dataset->count; i++) {
-            // Convert image to matrix
-            Mat input = mat_alloc(1, dataset->image_sizes[i]);
-            for (int j = 0; j < dataset->image_sizes[i]; j++) {
-                MAT_AT(input, 0, j) = dataset->images[i][j];
+        size_t samples = 0;
+        size_t in_batch = 0;
+
+        if (stream) {
+            // One epoch is every batch up to the one flagged last
+            for (;;) {
+                Batch *batch = loader_next(loader);
+                metrics_set(metric_ids.queue_depth, loader_queue_depth(loader));
+                for (size_t i = 0; i < batch->count; i++) {
+                    total_cost += train_sample(neural_network, gradient, batch->images + i * input_size, input_size, batch->labels[i]);
+                    if (++in_batch == batch_size) {
+                        PROF_BEGIN(t_optim);
+                        optim_step(&optimizer, neural_network, gradient, in_batch);
+                        PROF_END(t_optim, PROF_OPTIM);
+                        checkpoint_step(checkpointer, neural_network, optimizer.t);
+                        in_batch = 0;
+                    }
+                }
+                samples += batch->count;
+
+                int last = batch->last;
+                loader_release(loader, batch);
+                if (last) break;
             }
-
-            // One-hot encode the label
-            Mat target = one_hot_encode(dataset->labels[i], num_classes);
-
-            // Copy input to the network's input layer
-            mat_copy(neural_network.as[0], input);
-
-            // Forward pass
-            nn_forward(neural_network);
-
-            // Compute cost
-            double cost = 0.0f;
-            for (size_t j = 0; j < num_classes; j++) {
-                double diff = MAT_AT(neural_network.as[neural_network.size], 0, j) - MAT_AT(target, 0, j);
-                cost += diff * diff;
+        } else {
+            sampler_shuffle(sampler, epoch);
+            for (int k = 0; k < dataset->count; k++) {
+                size_t i = sampler.order[k];
+                total_cost += train_sample(neural_network, gradient, dataset->images[i], dataset->image_sizes[i], dataset->labels[i]);
+
+                // Update once a full batch has been accumulated
+                if (++in_batch == batch_size) {
+                    PROF_BEGIN(t_optim);
+                    optim_step(&optimizer, neural_network, gradient, in_batch);
+                    PROF_END(t_optim, PROF_OPTIM);
+                    checkpoint_step(checkpointer, neural_network, optimizer.t);
+                    in_batch = 0;
+                }
             }
+            samples = dataset->count;
+        }
 
-            total_cost += cost;
-
-            // Backpropagation
-            nn_backprop(neural_network, input, target, learning_rate);
-
-            // Free temporary matrices
-            mat_free(input);
-            mat_free(target);
+        // Apply what is left of the last batch
+        if (in_batch > 0) {
+            optim_step(&optimizer, neural_network, gradient, in_batch);
+            checkpoint_step(checkpointer, neural_network, optimizer.t);
         }
 
         // Compute average cost for the epoch
-        float average_cost = total_cost / dataset->count;
+        float average_cost = total_cost / samples;
+        PROF_END(t_epoch, PROF_EPOCH);
+        PROF_TRACE_END(tr_epoch, "epoch", -1);
+
+        MatStats stats = mat_stats();
+        metrics_set(metric_ids.samples_per_second, samples / (wall_seconds() - epoch_start));
+        metrics_set(metric_ids.epoch, epoch + 1);
+        metrics_set(metric_ids.epoch_cost, average_cost);
+        metrics_add(metric_ids.samples, samples);
+        metrics_set(metric_ids.mat_allocs, stats.allocs);
+        metrics_set(metric_ids.mat_bytes, stats.bytes);
+        for (size_t l = 0; l < neural_network.size && l < PROF_MAX_LAYERS; l++) {
+            metrics_set(metric_ids.layer_forward[l], prof_seconds(PROF_LAYER_FORWARD(l)));
+            metrics_set(metric_ids.layer_backward[l], prof_seconds(PROF_LAYER_BACKWARD(l)));
+        }
     
         // Print progress every 100 epochs
         //if ((epoch + 1) % 100 == 0 || epoch == 0) {
             printf("Epoch %d/%d, Cost: %.4f\n", epoch + 1, epochs, average_cost);
+            PROF_EPOCH_REPORT(stdout);
         //}
-    }
-
-    // Save trained model
-    nn_save(neural_network, "nn_configuration.txt");
 
+        // Validate, keep the best weights and stop once the validation cost stops improving
+        if (validation != NULL && (epoch + 1) % eval_every == 0) {
+            Evaluation val = nn_evaluate(neural_network, validation, eval_batch_size, eval_threads);
+            printf("Validation Cost: %.4f, Accuracy: %.2f%%\n", val.cost, val.accuracy);
+            metrics_set(metric_ids.validation_cost, val.cost);
+            metrics_set(metric_ids.validation_accuracy, val.accuracy);
+            eval_free(val);
+
+            if (val.cost < best_cost) {
+                best_cost = val.cost;
+                best_epoch = epoch + 1;
+                checks_without_improvement = 0;
+                nn_copy(best_network, neural_network);
+            } else if (++checks_without_improvement >= patience) {
+                printf("Early stopping at epoch %d, best epoch was %d.\n", epoch + 1, best_epoch);
+                break;
+            }
+        }
 
-    // Evaluation on the training set (for demonstration)
-    int correct = 0;
-    for (int i = 0; i < dataset->count; i++) {
-        // Convert image to matrix
-        Mat input = mat_alloc(1, dataset->image_sizes[i]);
-        for (int j = 0; j < dataset->image_sizes[i]; j++) {
-            MAT_AT(input, 0, j) = dataset->images[i][j];
+        if (metrics_file != NULL) {
+            metrics_write_file(metrics_file);
         }
+    }
 
-        int predicted = nn_predict(neural_network, input);
+    if (metrics_file != NULL) {
+        metrics_write_file(metrics_file);
+    }
 
-        // Check if prediction is correct
-        if (predicted == dataset->labels[i]) {
-            correct++;
-        }
+    // Let the last periodic checkpoint finish
+    if (checkpointer != NULL) {
+        CheckpointStats checkpoints = checkpoint_close(checkpointer);
+        printf("Checkpoints: %lu written, %lu skipped while busy, %lu failed\n",
+               checkpoints.written, checkpoints.skipped, checkpoints.failed);
+    }
 
-        // Free temporary matrices
-        mat_free(input);
+    // Restore the best checkpoint before saving
+    if (best_epoch > 0) {
+        nn_copy(neural_network, best_network);
     }
 
+    // Save trained model
+    nn_save(neural_network, "nn_configuration.txt");
 
 
-    float accuracy = (float)correct / dataset->count * 100.0f;
-    printf("Training Accuracy: %.2f%% (%d/%d)\n", accuracy, correct, dataset->count);
+    // Evaluation on the training set (for demonstration)
+    Evaluation train = stream ? nn_evaluate_loader(neural_network, loader)
+                              : nn_evaluate(neural_network, dataset, eval_batch_size, eval_threads);
+    printf("Training Accuracy: %.2f%% (%d/%d)\n", train.accuracy, train.correct, train.count);
+
+    // Per class breakdown on the held out set when there is one
+    if (validation != NULL) {
+        Evaluation val = nn_evaluate(neural_network, validation, eval_batch_size, eval_threads);
+        printf("Validation Accuracy: %.2f%% (%d/%d)\n", val.accuracy, val.correct, val.count);
+        eval_print(val, stdout);
+        eval_free(val);
+    } else {
+        eval_print(train, stdout);
+    }
+    eval_free(train);
 
     // Free the neural network
+    optim_free(optimizer);
+    sampler_free(sampler);
+    nn_free(best_network);
+    nn_free(gradient);
     nn_free(neural_network);
 
     // Free the dataset
-    for (int i = 0; i < dataset->count; i++) {
-        free(dataset->images[i]);
-    }
-    free(dataset->images);
-    free(dataset->image_sizes);
-    free(dataset->labels);
-    free(dataset);
+    loader_close(loader);
+    prof_trace_close();
+    metrics_stop();
+    dataset_free(validation);
+    dataset_free(dataset);
     return 0;
 }
 
@@ -0,0 +1,565 @@
+#include "allreduce.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Broadcasts are forwarded in pieces of this many floats, so every rank of the ring sends at once
+#define RING_BROADCAST_PIECE 16384
+
+// Top-k estimates its threshold from every RING_TOPK_STRIDE-th value
+#define RING_TOPK_STRIDE 32
+
+static double ring_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fill a socket address from "unix:PATH" or "tcp:HOST:PORT", returns the length or 0 on a bad address
+static socklen_t ring_address(const char *peer, struct sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(peer, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(peer + 5) >= sizeof(un->sun_path)) return 0;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, peer + 5);
+        return sizeof(*un);
+    }
+    if (strncmp(peer, "tcp:", 4) == 0) {
+        char host[RING_ADDR_MAX];
+        snprintf(host, sizeof(host), "%s", peer + 4);
+        char *port = strrchr(host, ':');
+        if (!port) return 0;
+        *port++ = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *found;
+        if (getaddrinfo(host, port, &hints, &found) != 0) return 0;
+        socklen_t len = found->ai_addrlen;
+        memcpy(addr, found->ai_addr, len);
+        freeaddrinfo(found);
+        return len;
+    }
+    return 0;
+}
+
+// Both ends of a connection send small pieces back to back, Nagle would hold them for an ack
+// TCP_NODELAY simply fails on a Unix socket
+static void ring_tune(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int ring_listen(const char *peer) {
+    struct sockaddr_storage addr;
+    socklen_t len = ring_address(peer, &addr);
+    if (len == 0) {
+        fprintf(stderr, "ring: bad address %s\n", peer);
+        return -1;
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    int one = 1;
+    if (addr.ss_family == AF_UNIX) unlink(((struct sockaddr_un *)&addr)->sun_path);
+    else setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "ring: cannot listen on %s: %s\n", peer, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Connect to the right neighbour, retrying until it listens, and tell it who we are
+static int ring_dial(const char *peer, int rank) {
+    struct sockaddr_storage addr;
+    socklen_t len = ring_address(peer, &addr);
+    if (len == 0) {
+        fprintf(stderr, "ring: bad address %s\n", peer);
+        return -1;
+    }
+    double deadline = ring_now() + RING_CONNECT_TIMEOUT;
+    for (;;) {
+        int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, len) == 0) {
+            int32_t id = rank;
+            if (send(fd, &id, sizeof(id), MSG_NOSIGNAL) == sizeof(id)) return fd;
+        }
+        if (fd >= 0) close(fd);
+        if (ring_now() > deadline) {
+            fprintf(stderr, "ring: cannot connect to %s: %s\n", peer, strerror(errno));
+            return -1;
+        }
+        usleep(10000);
+    }
+}
+
+// Accept the left neighbour, anything else knocking on the listener is dropped
+static int ring_accept(int listener, int expected) {
+    double deadline = ring_now() + RING_CONNECT_TIMEOUT;
+    while (ring_now() < deadline) {
+        struct pollfd p = { listener, POLLIN, 0 };
+        if (poll(&p, 1, 100) <= 0) continue;
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+
+        int32_t id = -1;
+        struct pollfd q = { fd, POLLIN, 0 };
+        if (poll(&q, 1, 1000) == 1 && recv(fd, &id, sizeof(id), MSG_WAITALL) == sizeof(id) && id == expected) return fd;
+        close(fd);
+    }
+    fprintf(stderr, "ring: rank %d never connected\n", expected);
+    return -1;
+}
+
+// Send send_bytes to the right while receiving recv_bytes from the left
+// Both directions progress together, a blocking send could wait on a neighbour that is itself blocked sending
+static int ring_exchange(Ring *ring, const void *send_buf, size_t send_bytes, void *recv_buf, size_t recv_bytes) {
+    size_t sent = 0, got = 0;
+    while (sent < send_bytes || got < recv_bytes) {
+        struct pollfd fds[2];
+        int n = 0, out = -1, in = -1;
+        if (sent < send_bytes) { fds[n] = (struct pollfd){ ring->right, POLLOUT, 0 }; out = n++; }
+        if (got < recv_bytes) { fds[n] = (struct pollfd){ ring->left, POLLIN, 0 }; in = n++; }
+
+        int ready = poll(fds, n, RING_IO_TIMEOUT * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            fprintf(stderr, "ring %d: neighbour timed out\n", ring->rank);
+            return -1;
+        }
+
+        if (out >= 0 && fds[out].revents) {
+            ssize_t w = send(ring->right, (const char *)send_buf + sent, send_bytes - sent, MSG_NOSIGNAL);
+            if (w < 0 && errno != EAGAIN && errno != EINTR) return -1;
+            if (w > 0) sent += w;
+        }
+        if (in >= 0 && fds[in].revents) {
+            ssize_t r = recv(ring->left, (char *)recv_buf + got, recv_bytes - got, 0);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) return -1;
+            if (r > 0) got += r;
+        }
+    }
+    ring->bytes_sent += send_bytes;
+    return 0;
+}
+
+// Connect rank to its two neighbours, peers[i] is where rank i listens
+// Every rank listens before it dials, so the ranks can be started in any order
+Ring *ring_open(const char **peers, int world, int rank) {
+    assert(world > 0 && rank >= 0 && rank < world);
+    Ring *ring = calloc(1, sizeof(Ring));
+    assert(ring != NULL);
+    ring->rank = rank;
+    ring->world = world;
+    ring->left = ring->right = -1;
+
+    if (world > 1) {
+        int listener = ring_listen(peers[rank]);
+        if (listener < 0) {
+            free(ring);
+            return NULL;
+        }
+        ring->right = ring_dial(peers[(rank + 1) % world], rank);
+        ring->left = ring->right >= 0 ? ring_accept(listener, (rank + world - 1) % world) : -1;
+        close(listener);
+        if (strncmp(peers[rank], "unix:", 5) == 0) unlink(peers[rank] + 5);
+        if (ring->left < 0) {
+            if (ring->right >= 0) close(ring->right);
+            free(ring);
+            return NULL;
+        }
+        ring_tune(ring->left);
+        ring_tune(ring->right);
+    }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->posted, NULL);
+    pthread_cond_init(&ring->drained, NULL);
+    return ring;
+}
+
+// Chunk c of an array split in world parts is [ring_start(c), ring_start(c + 1))
+static size_t ring_start(size_t count, int world, int c) {
+    return count * c / world;
+}
+
+static void ring_reserve_chunk(Ring *ring, size_t count) {
+    size_t largest = count / ring->world + 1;
+    if (ring->chunk_count < largest) {
+        free(ring->chunk);
+        ring->chunk = malloc(largest * sizeof(float));
+        assert(ring->chunk != NULL);
+        ring->chunk_count = largest;
+    }
+}
+
+static unsigned char *ring_reserve_packed(Ring *ring, size_t bytes) {
+    if (ring->packed_size < bytes) {
+        free(ring->packed);
+        ring->packed = malloc(bytes);
+        assert(ring->packed != NULL);
+        ring->packed_size = bytes;
+    }
+    return ring->packed;
+}
+
+static int ring_sum(Ring *ring, float *data, size_t count) {
+    int world = ring->world, rank = ring->rank;
+    ring_reserve_chunk(ring, count);
+
+    // Reduce-scatter: at step s chunk rank - s goes right and chunk rank - s - 1 comes in from the left,
+    // after world - 1 steps this rank holds the full sum of chunk rank + 1
+    for (int s = 0; s < world - 1; s++) {
+        int out = (rank - s + world) % world, in = (rank - s - 1 + world) % world;
+        size_t out_start = ring_start(count, world, out), in_start = ring_start(count, world, in);
+        size_t out_count = ring_start(count, world, out + 1) - out_start;
+        size_t in_count = ring_start(count, world, in + 1) - in_start;
+        if (ring_exchange(ring, data + out_start, out_count * sizeof(float), ring->chunk, in_count * sizeof(float)) != 0) return -1;
+
+        float *restrict dst = data + in_start;
+        const float *restrict src = ring->chunk;
+        #pragma omp simd
+        for (size_t i = 0; i < in_count; i++) dst[i] += src[i];
+    }
+
+    // All-gather: the finished chunks go once around the ring, overwriting the partial sums
+    for (int s = 0; s < world - 1; s++) {
+        int out = (rank + 1 - s + world) % world, in = (rank - s + world) % world;
+        size_t out_start = ring_start(count, world, out), in_start = ring_start(count, world, in);
+        size_t out_count = ring_start(count, world, out + 1) - out_start;
+        size_t in_count = ring_start(count, world, in + 1) - in_start;
+        if (ring_exchange(ring, data + out_start, out_count * sizeof(float), data + in_start, in_count * sizeof(float)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Sum data over every rank, must not run while posted segments are pending
+int ring_allreduce(Ring *ring, float *data, size_t count) {
+    if (ring->world == 1) return 0;
+    double start = ring_now();
+    int status = ring_sum(ring, data, count);
+    ring->busy_seconds += ring_now() - start;
+    return status;
+}
+
+// A q8 packet is the scale followed by one signed byte per value, value = byte * scale
+static size_t q8_size(size_t count) {
+    return sizeof(float) + count;
+}
+
+// Round values to the nearest of 255 levels spanning their largest magnitude, the rounding error is what
+// this rank failed to send and goes to residual
+static void q8_pack(unsigned char *packet, const float *restrict values, float *restrict residual, size_t count) {
+    float max = 0.0f;
+    #pragma omp simd reduction(max:max)
+    for (size_t i = 0; i < count; i++) {
+        float magnitude = fabsf(values[i]);
+        max = magnitude > max ? magnitude : max;
+    }
+    float scale = max / 127.0f, inverse = max > 0.0f ? 127.0f / max : 0.0f;
+    memcpy(packet, &scale, sizeof(float));
+
+    // Adding and subtracting 1.5 * 2^23 rounds anything below 2^22 to the nearest integer, unlike rintf
+    // it vectorizes without SSE4.1
+    signed char *restrict q = (signed char *)(packet + sizeof(float));
+    #pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+        float level = (values[i] * inverse + 12582912.0f) - 12582912.0f;
+        q[i] = (signed char)level;
+        residual[i] = values[i] - level * scale;
+    }
+}
+
+// Decode a packet into values, or add it to them
+static void q8_unpack(const unsigned char *packet, float *restrict values, size_t count, int add) {
+    float scale;
+    memcpy(&scale, packet, sizeof(float));
+    const signed char *restrict q = (const signed char *)(packet + sizeof(float));
+    if (add) {
+        #pragma omp simd
+        for (size_t i = 0; i < count; i++) values[i] += q[i] * scale;
+    } else {
+        #pragma omp simd
+        for (size_t i = 0; i < count; i++) values[i] = q[i] * scale;
+    }
+}
+
+// The ring of ring_sum with every chunk on the wire as a q8 packet
+// Each rank quantizes every index exactly once, partial sums on the way and its finished chunk at the end,
+// so the residuals of all ranks together hold the whole quantization error of the sum
+// The finished chunks go around as the very bytes their owner produced, every rank decodes the same sum
+static int ring_sum_q8(Ring *ring, float *data, float *residual, size_t count) {
+    int world = ring->world, rank = ring->rank;
+    ring_reserve_chunk(ring, count + sizeof(float));
+    unsigned char *packed = ring_reserve_packed(ring, q8_size(count) + world * sizeof(float));
+
+    #pragma omp simd
+    for (size_t i = 0; i < count; i++) data[i] += residual[i];
+
+    // Chunk c is packed at ring_start(c) + c scales
+    #define Q8_AT(c) (packed + ring_start(count, world, c) + (c) * sizeof(float))
+
+    for (int s = 0; s < world - 1; s++) {
+        int out = (rank - s + world) % world, in = (rank - s - 1 + world) % world;
+        size_t out_start = ring_start(count, world, out), in_start = ring_start(count, world, in);
+        size_t out_count = ring_start(count, world, out + 1) - out_start;
+        size_t in_count = ring_start(count, world, in + 1) - in_start;
+        q8_pack(Q8_AT(out), data + out_start, residual + out_start, out_count);
+        if (ring_exchange(ring, Q8_AT(out), q8_size(out_count), ring->chunk, q8_size(in_count)) != 0) return -1;
+        q8_unpack((const unsigned char *)ring->chunk, data + in_start, in_count, 1);
+    }
+
+    int own = (rank + 1) % world;
+    size_t own_start = ring_start(count, world, own), own_count = ring_start(count, world, own + 1) - own_start;
+    q8_pack(Q8_AT(own), data + own_start, residual + own_start, own_count);
+    q8_unpack(Q8_AT(own), data + own_start, own_count, 0);
+
+    for (int s = 0; s < world - 1; s++) {
+        int out = (rank + 1 - s + world) % world, in = (rank - s + world) % world;
+        size_t out_count = ring_start(count, world, out + 1) - ring_start(count, world, out);
+        size_t in_start = ring_start(count, world, in), in_count = ring_start(count, world, in + 1) - in_start;
+        if (ring_exchange(ring, Q8_AT(out), q8_size(out_count), Q8_AT(in), q8_size(in_count)) != 0) return -1;
+        q8_unpack(Q8_AT(in), data + in_start, in_count, 0);
+    }
+
+    #undef Q8_AT
+    return 0;
+}
+
+// One kept value of a top-k block
+typedef struct{
+    uint32_t index;
+    float value;
+}TopkEntry;
+
+// k-th largest of values[0..count), reorders values (Hoare's selection)
+static float kth_largest(float *values, size_t count, size_t k) {
+    ptrdiff_t low = 0, high = (ptrdiff_t)count - 1, target = (ptrdiff_t)k - 1;
+    while (low < high) {
+        float pivot = values[target];
+        ptrdiff_t i = low, j = high;
+        do {
+            while (values[i] > pivot) i++;
+            while (pivot > values[j]) j--;
+            if (i <= j) {
+                float t = values[i];
+                values[i++] = values[j];
+                values[j--] = t;
+            }
+        } while (i <= j);
+        if (j < target) low = i;
+        if (target < i) high = j;
+    }
+    return values[target];
+}
+
+// Every rank keeps the k largest magnitudes of data + residual and leaves the rest in residual
+// The k entries of every rank go once around the ring and each rank adds them up in rank order,
+// so all of them end with the same sum
+static int ring_sum_topk(Ring *ring, float *data, float *residual, size_t count) {
+    int world = ring->world, rank = ring->rank;
+    size_t k = (size_t)(count * ring->topk_ratio);
+    if (k < 1) k = 1;
+    if (k > count) k = count;
+
+    if (ring->magnitudes_count < count) {
+        free(ring->magnitudes);
+        ring->magnitudes = malloc(count * sizeof(float));
+        assert(ring->magnitudes != NULL);
+        ring->magnitudes_count = count;
+    }
+    float *magnitudes = ring->magnitudes;
+    #pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+        data[i] += residual[i];
+        residual[i] = data[i];
+    }
+
+    // A strided sample gives a threshold a little below the real one, the exact one is then selected among
+    // the few values above it instead of all of them
+    size_t samples = count / RING_TOPK_STRIDE, sample_k = 2 * (k / RING_TOPK_STRIDE) + 1;
+    for (size_t j = 0; j < samples; j++) magnitudes[j] = fabsf(data[j * RING_TOPK_STRIDE]);
+    float estimate = sample_k <= samples ? kth_largest(magnitudes, samples, sample_k) : 0.0f;
+
+    size_t candidates = 0;
+    for (size_t i = 0; i < count; i++) {
+        float magnitude = fabsf(data[i]);
+        if (magnitude >= estimate) magnitudes[candidates++] = magnitude;
+    }
+    if (candidates < k) {
+        candidates = count;
+        for (size_t i = 0; i < count; i++) magnitudes[i] = fabsf(data[i]);
+    }
+    float threshold = kth_largest(magnitudes, candidates, k);
+
+    // Everything above the threshold, then ties with it in index order until there are k
+    TopkEntry *entries = (TopkEntry *)ring_reserve_packed(ring, (size_t)world * k * sizeof(TopkEntry));
+    TopkEntry *own = entries + (size_t)rank * k;
+    size_t kept = 0;
+    for (size_t i = 0; i < count && kept < k; i++) {
+        if (fabsf(data[i]) > threshold) own[kept++] = (TopkEntry){ (uint32_t)i, data[i] };
+    }
+    for (size_t i = 0; i < count && kept < k; i++) {
+        if (fabsf(data[i]) == threshold) own[kept++] = (TopkEntry){ (uint32_t)i, data[i] };
+    }
+    for (size_t e = 0; e < k; e++) residual[own[e].index] = 0.0f;
+
+    // All-gather of the fixed size blocks, block r - s goes right at step s
+    for (int s = 0; s < world - 1; s++) {
+        int out = (rank - s + world) % world, in = (rank - s - 1 + world) % world;
+        if (ring_exchange(ring, entries + (size_t)out * k, k * sizeof(TopkEntry), entries + (size_t)in * k, k * sizeof(TopkEntry)) != 0) return -1;
+    }
+
+    memset(data, 0, count * sizeof(float));
+    for (size_t e = 0; e < (size_t)world * k; e++) data[entries[e].index] += entries[e].value;
+    return 0;
+}
+
+// Compression used by ring_reduce and posted segments from now on, topk_ratio is the kept fraction for RING_TOPK
+void ring_compress(Ring *ring, RingCompression compression, float topk_ratio) {
+    assert(compression != RING_TOPK || (topk_ratio > 0.0f && topk_ratio <= 1.0f));
+    ring->compression = compression;
+    ring->topk_ratio = topk_ratio;
+}
+
+const char *ring_compression_name(RingCompression compression) {
+    switch (compression) {
+    case RING_EXACT: return "exact";
+    case RING_Q8:    return "q8";
+    case RING_TOPK:  return "topk";
+    default:         return "unknown";
+    }
+}
+
+// Sum data over every rank with the compression of ring_compress, every rank ends with the same bits
+// residual is the error feedback of this data, what compression dropped from earlier sums is added back
+// before compressing and what it drops now is left there. Unused for RING_EXACT and short arrays
+// Compression applies with a single rank too, so its effect on training can be measured anywhere
+int ring_reduce(Ring *ring, float *data, float *residual, size_t count) {
+    if (ring->compression == RING_EXACT || count < RING_COMPRESS_MIN) return ring_allreduce(ring, data, count);
+    double start = ring_now();
+    int status = ring->compression == RING_Q8 ? ring_sum_q8(ring, data, residual, count)
+                                              : ring_sum_topk(ring, data, residual, count);
+    ring->busy_seconds += ring_now() - start;
+    return status;
+}
+
+// Copy data of rank 0 to every rank, piece by piece down the ring
+int ring_broadcast(Ring *ring, float *data, size_t count) {
+    if (ring->world == 1) return 0;
+    int first = ring->rank == 0, last = ring->rank == ring->world - 1;
+    size_t pieces = (count + RING_BROADCAST_PIECE - 1) / RING_BROADCAST_PIECE;
+
+    // At step p rank 0 sends piece p, the others receive piece p while forwarding piece p - 1
+    for (size_t p = 0; p <= pieces; p++) {
+        size_t in = p, out = first ? p : p - 1;
+        int receive = !first && p < pieces;
+        int forward = !last && (first ? p < pieces : p > 0);
+
+        size_t in_count = receive ? count - in * RING_BROADCAST_PIECE : 0;
+        size_t out_count = forward ? count - out * RING_BROADCAST_PIECE : 0;
+        if (in_count > RING_BROADCAST_PIECE) in_count = RING_BROADCAST_PIECE;
+        if (out_count > RING_BROADCAST_PIECE) out_count = RING_BROADCAST_PIECE;
+        if (ring_exchange(ring, data + out * RING_BROADCAST_PIECE, out_count * sizeof(float),
+                          data + in * RING_BROADCAST_PIECE, in_count * sizeof(float)) != 0) return -1;
+    }
+    return 0;
+}
+
+static void *ring_thread(void *arg) {
+    Ring *ring = arg;
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (!ring->stop && ring->pending_done == ring->pending_count) {
+            pthread_cond_wait(&ring->posted, &ring->lock);
+        }
+        if (ring->pending_done == ring->pending_count) break;
+
+        RingSegment segment = ring->pending[ring->pending_done];
+        int failed = ring->failed;
+        pthread_mutex_unlock(&ring->lock);
+
+        // Once a transfer failed the ring is out of step, the rest is only marked done
+        if (!failed && ring_reduce(ring, segment.data, segment.residual, segment.count) != 0) failed = 1;
+
+        pthread_mutex_lock(&ring->lock);
+        ring->failed = failed;
+        ring->pending_done++;
+        if (ring->pending_done == ring->pending_count) pthread_cond_broadcast(&ring->drained);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+// Queue data to be summed by ring_reduce in the background, every rank must post the same segments in
+// the same order. data and residual belong to the ring until ring_wait returns
+// A single rank has nothing to wait for and reduces right away, so does a ring whose thread could not start
+void ring_post(Ring *ring, float *data, float *residual, size_t count) {
+    pthread_mutex_lock(&ring->lock);
+    if (ring->world > 1 && ring->thread_started == 0) {
+        ring->thread_started = pthread_create(&ring->thread, NULL, ring_thread, ring) == 0 ? 1 : -1;
+        if (ring->thread_started < 0) fprintf(stderr, "ring %d: no background thread, reducing inline\n", ring->rank);
+    }
+    if (ring->world == 1 || ring->thread_started < 0) {
+        // Nothing is pending without a thread, ring_wait returns at once
+        pthread_mutex_unlock(&ring->lock);
+        int failed = ring_reduce(ring, data, residual, count) != 0;
+        pthread_mutex_lock(&ring->lock);
+        ring->failed |= failed;
+        pthread_mutex_unlock(&ring->lock);
+        return;
+    }
+    if (ring->pending_count == ring->pending_capacity) {
+        ring->pending_capacity = ring->pending_capacity ? 2 * ring->pending_capacity : 16;
+        ring->pending = realloc(ring->pending, ring->pending_capacity * sizeof(RingSegment));
+        assert(ring->pending != NULL);
+    }
+    ring->pending[ring->pending_count++] = (RingSegment){ data, residual, count };
+    pthread_cond_signal(&ring->posted);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Block until every posted segment is summed, returns -1 if a transfer failed
+int ring_wait(Ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->pending_done != ring->pending_count) {
+        pthread_cond_wait(&ring->drained, &ring->lock);
+    }
+    ring->pending_done = ring->pending_count = 0;
+    int failed = ring->failed;
+    pthread_mutex_unlock(&ring->lock);
+    return failed ? -1 : 0;
+}
+
+void ring_close(Ring *ring) {
+    if (!ring) return;
+    if (ring->thread_started > 0) {
+        pthread_mutex_lock(&ring->lock);
+        ring->stop = 1;
+        pthread_cond_signal(&ring->posted);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->thread, NULL);
+    }
+    if (ring->left >= 0) close(ring->left);
+    if (ring->right >= 0) close(ring->right);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->posted);
+    pthread_cond_destroy(&ring->drained);
+    free(ring->pending);
+    free(ring->chunk);
+    free(ring->packed);
+    free(ring->magnitudes);
+    free(ring);
+}
@@ -0,0 +1,77 @@
+#include "checkpoint.h"
+
+static void *writer_thread(void *arg) {
+    Checkpointer *c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (!c->pending && !c->stop) {
+            pthread_cond_wait(&c->cond, &c->lock);
+        }
+        if (!c->pending) break;
+
+        // The snapshot is only touched again once pending is cleared, so save it unlocked
+        pthread_mutex_unlock(&c->lock);
+        int status = nn_save(c->snapshot, c->path);
+        pthread_mutex_lock(&c->lock);
+
+        if (status == 0) c->stats.written++;
+        else c->stats.failed++;
+        c->pending = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Start a writer saving nn to path every `every` optimizer steps, every 0 disables checkpoints
+Checkpointer *checkpoint_open(NN nn, const char *path, unsigned long every) {
+    if (every == 0) return NULL;
+
+    Checkpointer *c = calloc(1, sizeof(Checkpointer));
+    assert(c != NULL);
+    c->snapshot = nn_alloc_like(nn);
+    c->every = every;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    pthread_create(&c->thread, NULL, writer_thread, c);
+    return c;
+}
+
+// Call after every optimizer step, snapshots nn when a checkpoint is due and the writer is idle
+// Returns 1 if a checkpoint was started. The only cost on the training thread is the copy.
+int checkpoint_step(Checkpointer *c, NN nn, unsigned long step) {
+    if (c == NULL || step % c->every != 0) return 0;
+
+    pthread_mutex_lock(&c->lock);
+    int started = !c->pending;
+    if (started) {
+        nn_copy(c->snapshot, nn);
+        c->step = step;
+        c->pending = 1;
+        pthread_cond_signal(&c->cond);
+    } else {
+        c->stats.skipped++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return started;
+}
+
+// Finish the checkpoint in flight, stop the writer and return what it did
+CheckpointStats checkpoint_close(Checkpointer *c) {
+    CheckpointStats stats = {0};
+    if (c == NULL) return stats;
+
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+
+    stats = c->stats;
+    nn_free(c->snapshot);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    return stats;
+}
@@ -0,0 +1,193 @@
+#include "eval.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Work shared by the nn_evaluate threads, batches are claimed one at a time from next
+typedef struct{
+    NN nn;
+    Dataset *dataset;
+    size_t batch_size;
+    size_t batches;
+    atomic_size_t next;
+    double *batch_costs; // summed in batch order at the end, so the cost doesn't depend on the thread count
+}EvalJob;
+
+// What one thread counted, reduced once every thread is done
+typedef struct{
+    EvalJob *job;
+    int correct;
+    int *confusion;
+}EvalWorker;
+
+// Count the predictions of rows [0, n) of the output of batch and return their summed cost
+static double eval_rows(NN batch, const int *labels, size_t n, int *correct, int *confusion) {
+    int num_classes = (int)NN_OUTPUT(batch).cols;
+    double cost = 0.0;
+    for (size_t r = 0; r < n; r++) {
+        int label = labels[r];
+        assert(label >= 0 && label < num_classes);
+        int predicted = nn_argmax(batch, r);
+        if (predicted == label) (*correct)++;
+        confusion[label * num_classes + predicted]++;
+        cost -= logf(fmaxf(MAT_AT(NN_OUTPUT(batch), r, label), NN_LOG_EPS));
+    }
+    return cost;
+}
+
+// Each thread runs its own activations over the shared weights, so nothing is written outside the worker
+// A heap context rather than mat_scratch, the arena of a thread that exits would never be freed
+static void *eval_thread(void *arg) {
+    EvalWorker *w = arg;
+    EvalJob *job = w->job;
+    Dataset *dataset = job->dataset;
+    NN batch = nn_batch_alloc(job->nn, job->batch_size);
+    size_t input_size = batch.as[0].cols;
+
+    for (;;) {
+        size_t b = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (b >= job->batches) break;
+
+        size_t start = b * job->batch_size;
+        size_t n = (size_t)dataset->count - start < job->batch_size ? (size_t)dataset->count - start : job->batch_size;
+        nn_batch_rows(batch, n);
+        for (size_t r = 0; r < n; r++) {
+            assert((size_t)dataset->image_sizes[start + r] == input_size);
+            memcpy(&MAT_AT(batch.as[0], r, 0), dataset->images[start + r], input_size * sizeof(float));
+        }
+        nn_forward(batch);
+
+        job->batch_costs[b] = eval_rows(batch, &dataset->labels[start], n, &w->correct, w->confusion);
+    }
+
+    nn_batch_free(batch);
+    return NULL;
+}
+
+static void eval_finish(Evaluation *eval, double total_cost) {
+    if (eval->count > 0) {
+        eval->accuracy = (float)eval->correct / eval->count * 100.0f;
+        eval->cost = (float)(total_cost / eval->count);
+    }
+}
+
+// Accuracy, average cost and confusion matrix of nn over a dataset, batch_size images per forward pass
+// The batches are spread over threads (EVAL_THREADS_AUTO for one per CPU), each with private activations,
+// so the activations of nn are left untouched. Release the result with eval_free
+Evaluation nn_evaluate(NN nn, Dataset *dataset, size_t batch_size, size_t threads) {
+    assert(batch_size > 0);
+    Evaluation eval = {0};
+    eval.num_classes = (int)NN_OUTPUT(nn).cols;
+    eval.confusion = calloc((size_t)eval.num_classes * eval.num_classes, sizeof(int));
+    assert(eval.confusion != NULL);
+    if (dataset == NULL || dataset->count == 0) return eval;
+
+    EvalJob job = { .nn = nn, .dataset = dataset, .batch_size = batch_size };
+    job.batches = (dataset->count + batch_size - 1) / batch_size;
+    atomic_init(&job.next, 0);
+    job.batch_costs = malloc(job.batches * sizeof(double));
+    assert(job.batch_costs != NULL);
+
+    if (threads == EVAL_THREADS_AUTO) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (threads > job.batches) threads = job.batches;
+
+    // The calling thread is worker 0
+    EvalWorker *workers = calloc(threads, sizeof(EvalWorker));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    assert(workers != NULL && tids != NULL);
+    for (size_t t = 0; t < threads; t++) {
+        workers[t].job = &job;
+        workers[t].confusion = t == 0 ? eval.confusion : calloc((size_t)eval.num_classes * eval.num_classes, sizeof(int));
+        assert(workers[t].confusion != NULL);
+    }
+    // Worker 0 drains whatever the others don't claim, so a thread that fails to start only costs speed
+    size_t started = 1;
+    while (started < threads && pthread_create(&tids[started], NULL, eval_thread, &workers[started]) == 0) started++;
+    for (size_t t = started; t < threads; t++) free(workers[t].confusion);
+    threads = started;
+    eval_thread(&workers[0]);
+
+    eval.correct = workers[0].correct;
+    for (size_t t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        eval.correct += workers[t].correct;
+        for (int i = 0; i < eval.num_classes * eval.num_classes; i++) {
+            eval.confusion[i] += workers[t].confusion[i];
+        }
+        free(workers[t].confusion);
+    }
+
+    double total_cost = 0.0;
+    for (size_t b = 0; b < job.batches; b++) total_cost += job.batch_costs[b];
+
+    eval.count = dataset->count;
+    eval_finish(&eval, total_cost);
+
+    free(job.batch_costs);
+    free(workers);
+    free(tids);
+    return eval;
+}
+
+// Same as nn_evaluate over exactly one epoch of a streaming loader, batch by batch as they are decoded
+// Single threaded, the loader hands out batches in order to one consumer and decoding is the bottleneck
+Evaluation nn_evaluate_loader(NN nn, Loader *loader) {
+    Evaluation eval = {0};
+    eval.num_classes = (int)NN_OUTPUT(nn).cols;
+    eval.confusion = calloc((size_t)eval.num_classes * eval.num_classes, sizeof(int));
+    assert(eval.confusion != NULL);
+
+    Arena *scratch = mat_scratch();
+    ArenaMark mark = arena_mark(scratch);
+    NN batch = nn_batch_alloc_in(scratch, nn, loader->batch_size);
+
+    double total_cost = 0.0;
+    for (;;) {
+        Batch *b = loader_next(loader);
+        nn_batch_rows(batch, b->count);
+
+        // The decoded batch is contiguous, so layer 0 reads it in place
+        Mat own = nn_set_input(batch, mat_view(b->images, b->count, loader->image_size, loader->image_size));
+        if (b->count > 0) nn_forward(batch);
+        nn_set_input(batch, own);
+
+        total_cost += eval_rows(batch, b->labels, b->count, &eval.correct, eval.confusion);
+        eval.count += b->count;
+
+        int last = b->last;
+        loader_release(loader, b);
+        if (last) break;
+    }
+
+    arena_reset(scratch, mark);
+
+    eval_finish(&eval, total_cost);
+    return eval;
+}
+
+// Percent of the samples of a class that were predicted as that class, 0 when the class has no samples
+float eval_class_accuracy(Evaluation eval, int label) {
+    assert(label >= 0 && label < eval.num_classes);
+    int total = 0;
+    for (int j = 0; j < eval.num_classes; j++) total += eval.confusion[label * eval.num_classes + j];
+    return total ? (float)eval.confusion[label * eval.num_classes + label] / total * 100.0f : 0.0f;
+}
+
+// Per class accuracy and the confusion matrix, one row per true label
+void eval_print(Evaluation eval, FILE *out) {
+    fprintf(out, "Class  Accuracy  Predictions\n");
+    for (int i = 0; i < eval.num_classes; i++) {
+        fprintf(out, "%5d  %7.2f%% ", i, eval_class_accuracy(eval, i));
+        for (int j = 0; j < eval.num_classes; j++) {
+            fprintf(out, " %5d", eval.confusion[i * eval.num_classes + j]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void eval_free(Evaluation eval) {
+    free(eval.confusion);
+}
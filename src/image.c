@@ -1,5 +1,7 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "image.h"
+#include "matrix.h"
+#include "prof.h"
 
 #define MAX_CLASSES 100
 
@@ -56,6 +58,31 @@ float *load_image(const char *filename, int *width, int *height, int *channels)
     return image_data;
 }
 
+// Same as load_image for an encoded image already in memory, e.g. received over a socket
+float *load_image_from_memory(const unsigned char *data, int size, int *width, int *height) {
+    int channels;
+    unsigned char *img = stbi_load_from_memory(data, size, width, height, &channels, 3);
+    if (img == NULL) {
+        fprintf(stderr, "Error: Could not decode image from memory: %s.\n", stbi_failure_reason());
+        return NULL;
+    }
+
+    int img_size = (*width) * (*height) * 3;
+    float *image_data = malloc(img_size * sizeof(float));
+    if (!image_data) {
+        fprintf(stderr, "Failed to allocate memory for image data.\n");
+        stbi_image_free(img);
+        return NULL;
+    }
+
+    for (int i = 0; i < img_size; i++) {
+        image_data[i] = (float)img[i] / 255.0f; // Normalization
+    }
+
+    stbi_image_free(img);
+    return image_data;
+}
+
 // Iterate through a directory and store the images loaded into an array of float pointers
 float **process_directory(const char *dir_name, int *count, int **image_sizes) {
     *count = count_images_in_directory(dir_name);
@@ -140,19 +167,13 @@ int get_class_label(const char *class_name, char class_names[][256], int *num_cl
     return (*num_classes - 1);
 }
 
-// 
-Dataset* process_directory_with_labels(const char *dir_name) {
-    Dataset *dataset = malloc(sizeof(Dataset));
-    if (!dataset) {
-        fprintf(stderr, "Failed to allocate memory for dataset.\n");
-        exit(1);
-    }
-
-    dataset->images = NULL;
-    dataset->image_sizes = NULL;
-    dataset->labels = NULL;
-    dataset->count = 0;
-    dataset->num_classes = 0;
+// Collect the path and label of every image in DATASET/CLASS_NAMES/IMAGES without decoding anything
+// Returns the number of images, *paths and *labels are malloc'd arrays owned by the caller
+int list_directory_with_labels(const char *dir_name, char ***paths, int **labels, int *num_classes) {
+    *paths = NULL;
+    *labels = NULL;
+    *num_classes = 0;
+    int count = 0;
 
     char class_names[MAX_CLASSES][256]; // Store unique class names
 
@@ -161,8 +182,7 @@ Dataset* process_directory_with_labels(const char *dir_name) {
 
     if (!main_dir) {
         printf("Error: Could not open main directory %s.\n", dir_name);
-        free(dataset);
-        return NULL;
+        return -1;
     }
 
     while ((class_entry = readdir(main_dir)) != NULL) {
@@ -172,37 +192,27 @@ Dataset* process_directory_with_labels(const char *dir_name) {
             snprintf(class_path, sizeof(class_path), "%s/%s", dir_name, class_entry->d_name);
 
             // Get the class subfolder name / label
-            int class_label = get_class_label(class_entry->d_name, class_names, &dataset->num_classes);
+            int class_label = get_class_label(class_entry->d_name, class_names, num_classes);
 
-            // Process the images in the subfolder
             DIR *img_dir = opendir(class_path);
+            if (!img_dir) continue;
             struct dirent *img_entry;
 
             while ((img_entry = readdir(img_dir)) != NULL) {
                 if (img_entry->d_type == DT_REG) {
                     // If it's a regular file
-                    char img_path[1024];
+                    char img_path[1280];
                     snprintf(img_path, sizeof(img_path), "%s/%s", class_path, img_entry->d_name);
 
-                    // Load the image
-                    int width, height, channels;
-                    float *image = load_image(img_path, &width, &height, &channels);
-                    if (image == NULL) {
-                        fprintf(stderr, "Failed to load image: %s\n", img_path);
-                        continue;
+                    *paths = realloc(*paths, (count + 1) * sizeof(char *));
+                    *labels = realloc(*labels, (count + 1) * sizeof(int));
+                    if (!*paths || !*labels) {
+                        fprintf(stderr, "Failed to allocate memory for image list.\n");
+                        exit(1);
                     }
-
-                    // Reallocate memory to store this image
-                    dataset->images = realloc(dataset->images, (dataset->count + 1) * sizeof(float *));
-                    dataset->image_sizes = realloc(dataset->image_sizes, (dataset->count + 1) * sizeof(int));
-                    dataset->labels = realloc(dataset->labels, (dataset->count + 1) * sizeof(int));
-
-                    // Store the image and its size
-                    dataset->images[dataset->count] = image;
-                    dataset->image_sizes[dataset->count] = width * height * 3; // RGB channels
-                    dataset->labels[dataset->count] = class_label;
-
-                    dataset->count++;
+                    (*paths)[count] = strdup(img_path);
+                    (*labels)[count] = class_label;
+                    count++;
                 }
             }
 
@@ -212,5 +222,203 @@ Dataset* process_directory_with_labels(const char *dir_name) {
 
     closedir(main_dir); // Close the main dataset directory
 
+    return count;
+}
+
+// Decode an image straight into dst, normalized like load_image
+// Returns 0 on success, -1 if it can't be decoded or doesn't have exactly size values
+int load_image_into(const char *filename, float *dst, int size) {
+    int width, height, channels;
+    unsigned char *img = stbi_load(filename, &width, &height, &channels, 3);
+    if (img == NULL) {
+        printf("Error: Could not load image %s.\n", filename);
+        return -1;
+    }
+
+    int img_size = width * height * 3;
+    if (img_size != size) {
+        fprintf(stderr, "Image %s has %d values, expected %d.\n", filename, img_size, size);
+        stbi_image_free(img);
+        return -1;
+    }
+
+    for (int i = 0; i < img_size; i++) {
+        dst[i] = (float)img[i] / 255.0f; // Normalization
+    }
+
+    stbi_image_free(img);
+    return 0;
+}
+
+// Load every image of DATASET/CLASS_NAMES/IMAGES into memory
+Dataset* process_directory_with_labels(const char *dir_name) {
+    return process_directory_shard(dir_name, 0, 1);
+}
+
+// Load only the images i with i % world == rank, the shard of one data parallel worker
+// Files are listed class by class, so the stride keeps every class in every shard
+Dataset* process_directory_shard(const char *dir_name, int rank, int world) {
+    assert(world > 0 && rank >= 0 && rank < world);
+    Dataset *dataset = malloc(sizeof(Dataset));
+    if (!dataset) {
+        fprintf(stderr, "Failed to allocate memory for dataset.\n");
+        exit(1);
+    }
+
+    dataset->images = NULL;
+    dataset->image_sizes = NULL;
+    dataset->labels = NULL;
+    dataset->count = 0;
+    dataset->num_classes = 0;
+
+    char **paths;
+    int *labels;
+    int count = list_directory_with_labels(dir_name, &paths, &labels, &dataset->num_classes);
+    if (count < 0) {
+        free(dataset);
+        return NULL;
+    }
+
+    dataset->images = malloc(count * sizeof(float *));
+    dataset->image_sizes = malloc(count * sizeof(int));
+    dataset->labels = malloc(count * sizeof(int));
+    if (count > 0 && (!dataset->images || !dataset->image_sizes || !dataset->labels)) {
+        fprintf(stderr, "Failed to allocate memory for dataset.\n");
+        exit(1);
+    }
+
+    PROF_TRACE_BEGIN(tr_load, prof_trace_enabled());
+    for (int i = 0; i < count; i++) {
+        if (i % world != rank) {
+            free(paths[i]);
+            continue;
+        }
+
+        // Load the image
+        PROF_TRACE_BEGIN(tr_decode, prof_trace_enabled());
+        int width, height, channels;
+        float *image = load_image(paths[i], &width, &height, &channels);
+        PROF_TRACE_END(tr_decode, "decode_image", -1);
+        if (image == NULL) {
+            fprintf(stderr, "Failed to load image: %s\n", paths[i]);
+        } else {
+            // Store the image and its size
+            dataset->images[dataset->count] = image;
+            dataset->image_sizes[dataset->count] = width * height * 3; // RGB channels
+            dataset->labels[dataset->count] = labels[i];
+            dataset->count++;
+        }
+        free(paths[i]);
+    }
+    PROF_TRACE_END(tr_load, "process_directory_with_labels", -1);
+
+    free(paths);
+    free(labels);
     return dataset;
 }
+
+// Move every round(1/fraction)-th image into a new dataset, used as a held-out validation set
+// Taking a regular stride keeps every class represented since images are stored class by class
+Dataset* dataset_split(Dataset *dataset, float fraction) {
+    if (fraction <= 0.0f || fraction >= 1.0f) return NULL;
+
+    int step = (int)(1.0f / fraction + 0.5f);
+    int split_count = dataset->count / step;
+    if (split_count == 0) return NULL;
+
+    Dataset *split = malloc(sizeof(Dataset));
+    if (!split) {
+        fprintf(stderr, "Failed to allocate memory for dataset.\n");
+        exit(1);
+    }
+    split->images = malloc(split_count * sizeof(float *));
+    split->image_sizes = malloc(split_count * sizeof(int));
+    split->labels = malloc(split_count * sizeof(int));
+    if (!split->images || !split->image_sizes || !split->labels) {
+        fprintf(stderr, "Failed to allocate memory for dataset split.\n");
+        exit(1);
+    }
+    split->count = 0;
+    split->num_classes = dataset->num_classes;
+
+    // Compact the remaining images in place, the image buffers themselves are only moved
+    int kept = 0;
+    for (int i = 0; i < dataset->count; i++) {
+        if (i % step == step - 1 && split->count < split_count) {
+            split->images[split->count] = dataset->images[i];
+            split->image_sizes[split->count] = dataset->image_sizes[i];
+            split->labels[split->count] = dataset->labels[i];
+            split->count++;
+        } else {
+            dataset->images[kept] = dataset->images[i];
+            dataset->image_sizes[kept] = dataset->image_sizes[i];
+            dataset->labels[kept] = dataset->labels[i];
+            kept++;
+        }
+    }
+    dataset->count = kept;
+
+    return split;
+}
+
+// Keep only the images i with i % world == rank, freeing the others
+void dataset_shard(Dataset *dataset, int rank, int world) {
+    assert(world > 0 && rank >= 0 && rank < world);
+    int kept = 0;
+    for (int i = 0; i < dataset->count; i++) {
+        if (i % world != rank) {
+            free(dataset->images[i]);
+            continue;
+        }
+        dataset->images[kept] = dataset->images[i];
+        dataset->image_sizes[kept] = dataset->image_sizes[i];
+        dataset->labels[kept] = dataset->labels[i];
+        kept++;
+    }
+    dataset->count = kept;
+}
+
+// count images of input_size floats around one noisy prototype per class, so a network has something real to learn
+// Drawn from rand(), the same seed gives the same dataset
+Dataset* dataset_synthetic(int count, int input_size, int num_classes) {
+    Dataset *dataset = malloc(sizeof(Dataset));
+    assert(dataset != NULL);
+    dataset->images = malloc(count * sizeof(float *));
+    dataset->image_sizes = malloc(count * sizeof(int));
+    dataset->labels = malloc(count * sizeof(int));
+    assert(dataset->images && dataset->image_sizes && dataset->labels);
+    dataset->count = count;
+    dataset->num_classes = num_classes;
+
+    float *prototypes = malloc((size_t)num_classes * input_size * sizeof(float));
+    assert(prototypes != NULL);
+    for (int i = 0; i < num_classes * input_size; i++) prototypes[i] = rand_float();
+
+    for (int i = 0; i < count; i++) {
+        int label = i % num_classes;
+        float *image = malloc(input_size * sizeof(float));
+        assert(image != NULL);
+        for (int j = 0; j < input_size; j++) {
+            float v = prototypes[label * input_size + j] + (rand_float() - 0.5f) * 0.6f;
+            image[j] = v < 0 ? 0 : (v > 1 ? 1 : v);
+        }
+        dataset->images[i] = image;
+        dataset->image_sizes[i] = input_size;
+        dataset->labels[i] = label;
+    }
+
+    free(prototypes);
+    return dataset;
+}
+
+// Free a dataset and all of its images
+void dataset_free(Dataset *dataset) {
+    if (!dataset) return;
+    for (int i = 0; i < dataset->count; i++) {
+        free(dataset->images[i]);
+    }
+    free(dataset->images);
+    free(dataset->image_sizes);
+    free(dataset->labels);
+    free(dataset);
+}
@@ -0,0 +1,179 @@
+#include "loader.h"
+#include "image.h"
+#include "prof.h"
+
+// Decode one batch of the epoch into a ring slot, images that fail to load are skipped
+static void loader_fill(Loader *loader, Batch *batch, size_t epoch, size_t start) {
+    size_t end = start + loader->batch_size < (size_t)loader->count ? start + loader->batch_size : (size_t)loader->count;
+
+    batch->count = 0;
+    batch->epoch = epoch;
+    batch->last = end == (size_t)loader->count;
+
+    for (size_t k = start; k < end; k++) {
+        size_t i = loader->sampler.order[k];
+        float *dst = batch->images + batch->count * loader->image_size;
+        if (load_image_into(loader->paths[i], dst, loader->image_size) == 0) {
+            batch->labels[batch->count] = loader->labels[i];
+            batch->count++;
+        }
+    }
+}
+
+// Producer, decodes epoch after epoch until the loader is closed
+static void *loader_thread(void *arg) {
+    Loader *loader = arg;
+    prof_trace_thread_name("loader");
+
+    for (size_t epoch = 0;; epoch++) {
+        sampler_shuffle(loader->sampler, epoch);
+        for (size_t start = 0; start < (size_t)loader->count; start += loader->batch_size) {
+            // Wait for a free slot
+            pthread_mutex_lock(&loader->lock);
+            while (loader->filled == loader->ring_size && !loader->stop) {
+                pthread_cond_wait(&loader->not_full, &loader->lock);
+            }
+            if (loader->stop) {
+                pthread_mutex_unlock(&loader->lock);
+                return NULL;
+            }
+            Batch *batch = &loader->ring[loader->head];
+            pthread_mutex_unlock(&loader->lock);
+
+            // The slot isn't visible to the consumer until filled is bumped, so decode without the lock
+            PROF_TRACE_BEGIN(tr_fill, prof_trace_enabled());
+            loader_fill(loader, batch, epoch, start);
+            PROF_TRACE_END(tr_fill, "decode_batch", -1);
+
+            pthread_mutex_lock(&loader->lock);
+            loader->head = (loader->head + 1) % loader->ring_size;
+            loader->filled++;
+            pthread_cond_signal(&loader->not_empty);
+            pthread_mutex_unlock(&loader->lock);
+        }
+    }
+}
+
+// List the dataset and start decoding, ring_size batches of batch_size images are allocated up front
+// The file order of every epoch is a block shuffle seeded by seed, see sampler.h
+Loader* loader_open(const char *dir_name, size_t batch_size, size_t ring_size,
+                    size_t shuffle_block, size_t shuffle_window, uint64_t seed) {
+    assert(batch_size > 0);
+    assert(ring_size > 0);
+
+    Loader *loader = calloc(1, sizeof(Loader));
+    if (!loader) {
+        fprintf(stderr, "Failed to allocate memory for loader.\n");
+        exit(1);
+    }
+
+    loader->count = list_directory_with_labels(dir_name, &loader->paths, &loader->labels, &loader->num_classes);
+    if (loader->count <= 0) {
+        free(loader->paths);
+        free(loader->labels);
+        free(loader);
+        return NULL;
+    }
+
+    // All images must have the size of the first one that decodes
+    for (int i = 0; i < loader->count && loader->image_size == 0; i++) {
+        int width, height, channels;
+        float *image = load_image(loader->paths[i], &width, &height, &channels);
+        if (image != NULL) {
+            loader->image_size = width * height * 3;
+            free(image);
+        }
+    }
+    if (loader->image_size == 0) {
+        fprintf(stderr, "No image in %s could be decoded.\n", dir_name);
+        for (int i = 0; i < loader->count; i++) free(loader->paths[i]);
+        free(loader->paths);
+        free(loader->labels);
+        free(loader);
+        return NULL;
+    }
+
+    loader->sampler = sampler_alloc(loader->count, shuffle_block, shuffle_window, seed);
+    loader->batch_size = batch_size;
+    loader->ring_size = ring_size;
+    loader->ring = calloc(ring_size, sizeof(Batch));
+    if (!loader->ring) {
+        fprintf(stderr, "Failed to allocate memory for loader ring.\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < ring_size; i++) {
+        loader->ring[i].images = malloc(batch_size * loader->image_size * sizeof(float));
+        loader->ring[i].labels = malloc(batch_size * sizeof(int));
+        if (!loader->ring[i].images || !loader->ring[i].labels) {
+            fprintf(stderr, "Failed to allocate memory for loader batches.\n");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->not_empty, NULL);
+    pthread_cond_init(&loader->not_full, NULL);
+    if (pthread_create(&loader->thread, NULL, loader_thread, loader) != 0) {
+        fprintf(stderr, "Failed to start loader thread.\n");
+        exit(1);
+    }
+
+    return loader;
+}
+
+// Block until the next batch is decoded, it stays valid until loader_release
+Batch* loader_next(Loader *loader) {
+    pthread_mutex_lock(&loader->lock);
+    while (loader->filled == 0) {
+        pthread_cond_wait(&loader->not_empty, &loader->lock);
+    }
+    Batch *batch = &loader->ring[loader->tail];
+    pthread_mutex_unlock(&loader->lock);
+    return batch;
+}
+
+// Hand a batch back so its slot can be refilled, batches must be released in the order they were received
+void loader_release(Loader *loader, Batch *batch) {
+    pthread_mutex_lock(&loader->lock);
+    assert(batch == &loader->ring[loader->tail]);
+    loader->tail = (loader->tail + 1) % loader->ring_size;
+    loader->filled--;
+    pthread_cond_signal(&loader->not_full);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+// Number of decoded batches waiting to be consumed
+size_t loader_queue_depth(Loader *loader) {
+    pthread_mutex_lock(&loader->lock);
+    size_t depth = loader->filled;
+    pthread_mutex_unlock(&loader->lock);
+    return depth;
+}
+
+// Stop the thread and free everything
+void loader_close(Loader *loader) {
+    if (!loader) return;
+
+    pthread_mutex_lock(&loader->lock);
+    loader->stop = 1;
+    pthread_cond_broadcast(&loader->not_full);
+    pthread_mutex_unlock(&loader->lock);
+    pthread_join(loader->thread, NULL);
+
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->not_empty);
+    pthread_cond_destroy(&loader->not_full);
+
+    for (size_t i = 0; i < loader->ring_size; i++) {
+        free(loader->ring[i].images);
+        free(loader->ring[i].labels);
+    }
+    free(loader->ring);
+    sampler_free(loader->sampler);
+    for (int i = 0; i < loader->count; i++) {
+        free(loader->paths[i]);
+    }
+    free(loader->paths);
+    free(loader->labels);
+    free(loader);
+}
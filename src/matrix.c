@@ -1,4 +1,10 @@
 #include "matrix.h"
+#include <stdatomic.h>
+
+// Counters behind mat_stats, relaxed atomics so they stay cheap with several threads
+static atomic_size_t stat_allocs;
+static atomic_size_t stat_frees;
+static atomic_size_t stat_bytes;
 
 // Return a random float
 float rand_float(void){
@@ -13,9 +19,20 @@ Mat mat_alloc(size_t rows, size_t cols){
     m.stride = cols;
     m.es = calloc(rows*cols, sizeof(*m.es));
     assert(m.es != NULL);
+    atomic_fetch_add_explicit(&stat_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_bytes, rows*cols*sizeof(*m.es), memory_order_relaxed);
     return m;
 }
 
+// Number of matrices allocated and freed so far, and the bytes requested by mat_alloc
+MatStats mat_stats(void){
+    MatStats stats;
+    stats.allocs = atomic_load_explicit(&stat_allocs, memory_order_relaxed);
+    stats.frees = atomic_load_explicit(&stat_frees, memory_order_relaxed);
+    stats.bytes = atomic_load_explicit(&stat_bytes, memory_order_relaxed);
+    return stats;
+}
+
 // Randomize your matrix indicies values
 void mat_rand(Mat m, float low, float high) {
     for (size_t j = 0; j < m.rows; j++) {
@@ -25,13 +42,37 @@ void mat_rand(Mat m, float low, float high) {
     }
 }
 
-// Return a matrix 1xm.rows
+// Matrix over memory owned by someone else, e.g. a sample of a dataset, never mat_free it
+Mat mat_view(float *es, size_t rows, size_t cols, size_t stride){
+    return (Mat){ .rows = rows, .cols = cols, .stride = stride, .es = es };
+}
+
+// rows x cols block of m starting at (row, col), shares the memory and the stride of m
+Mat mat_sub(Mat m, size_t row, size_t col, size_t rows, size_t cols){
+    assert(row + rows <= m.rows);
+    assert(col + cols <= m.cols);
+    return mat_view(&MAT_AT(m, row, col), rows, cols, m.stride);
+}
+
+// Rows [start, start + count) of m, e.g. a batch slice of a dataset matrix
+Mat mat_rows(Mat m, size_t start, size_t count){
+    return mat_sub(m, start, 0, count, m.cols);
+}
+
+// Columns [start, start + count) of m, rows of the result are not contiguous
+Mat mat_cols(Mat m, size_t start, size_t count){
+    return mat_sub(m, 0, start, m.rows, count);
+}
+
+// Return a matrix 1xm.cols
 Mat mat_row(Mat m, size_t row){
-    return (Mat){
-        .rows = 1,
-        .cols = m.cols,
-        .es = &MAT_AT(m, row, 0)
-    };
+    return mat_rows(m, row, 1);
+}
+
+// Kernels walk a matrix row by row through its stride, when the rows of every operand are
+// back to back they collapse it into a single row of rows*cols so the inner loop runs once
+static inline int mat_flat(Mat m){
+    return m.stride == m.cols || m.rows == 1;
 }
 
 // Copy src matrix into dst matrix
@@ -39,59 +80,94 @@ void mat_copy(Mat dst, Mat src) {
     assert(dst.rows == src.rows);
     assert(dst.cols == src.cols);
     
-    for(size_t j = 0; j < src.rows; j++) {
-        for(size_t i = 0; i < src.cols; i++) {
-            MAT_AT(dst, j, i) = MAT_AT(src, j, i);
-        }
+    size_t rows = src.rows, cols = src.cols;
+    if (mat_flat(dst) && mat_flat(src)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; i++) {
+        memcpy(&MAT_AT(dst, i, 0), &MAT_AT(src, i, 0), cols * sizeof(float));
     }
 }
 
 
 // Multiply two matrices
-void mat_dot(Mat dst, Mat a, Mat b){
+MAT_SIMD void mat_dot(Mat dst, Mat a, Mat b){
     assert(a.cols == b.rows);
 
     assert(dst.cols == b.cols);
     assert(dst.rows == a.rows);
 
+    // Row i of dst is the sum of the rows of b weighted by row i of a, so every inner loop runs
+    // along a contiguous row whatever the strides are, and each element still sums k in order
     for(size_t i = 0; i < dst.rows; i++){
-        for(size_t j = 0; j < dst.cols; j++){
-            MAT_AT(dst, i, j) = 0;
-            for(size_t k = 0; k < a.cols; k++){
-                MAT_AT(dst, i, j) += MAT_AT(a, i, k)*MAT_AT(b, k, j); // a[0 0]* b[0 0] + a[0 1]*b[1 0]
+        float *restrict d = &MAT_AT(dst, i, 0);
+        memset(d, 0, dst.cols * sizeof(float));
+        for(size_t k = 0; k < a.cols; k++){
+            float aik = MAT_AT(a, i, k);
+            const float *restrict bk = &MAT_AT(b, k, 0);
+            #pragma omp simd
+            for(size_t j = 0; j < dst.cols; j++){
+                d[j] += aik * bk[j];
             }
         }
     }
 }
 
 // Add 2 matrices
-void mat_sum(Mat dst, Mat a)
+MAT_SIMD void mat_sum(Mat dst, Mat a)
 {
     assert(dst.rows == a.rows);
     assert(dst.cols == a.cols);
+    size_t rows = dst.rows, cols = dst.cols;
+    if (mat_flat(dst) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict d = &MAT_AT(dst, i, 0);
+        const float *restrict x = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            d[j] += x[j];
+        }
+    }
+}
+
+// Add a 1 x cols row to every row of dst, used to broadcast biases over a batch
+MAT_SIMD void mat_sum_row(Mat dst, Mat row)
+{
+    assert(row.rows == 1);
+    assert(dst.cols == row.cols);
+    const float *restrict x = row.es;
     for (size_t i = 0; i < dst.rows; ++i) {
+        float *restrict d = &MAT_AT(dst, i, 0);
+        #pragma omp simd
         for (size_t j = 0; j < dst.cols; ++j) {
-            MAT_AT(dst, i, j) += MAT_AT(a, i, j);
+            d[j] += x[j];
         }
     }
 }
 
 // Subtract 2 matrices
-void mat_subtract(Mat dst, Mat a){
+MAT_SIMD void mat_subtract(Mat dst, Mat a){
     assert(dst.rows == a.rows);
     assert(dst.cols == a.cols);
-    for(size_t i = 0; i < dst.rows; i++){
-        for(size_t j = 0; j < dst.cols; j++){
-            MAT_AT(dst,i,j) -= MAT_AT(a, i, j);
+    size_t rows = dst.rows, cols = dst.cols;
+    if (mat_flat(dst) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for(size_t i = 0; i < rows; i++){
+        float *restrict d = &MAT_AT(dst, i, 0);
+        const float *restrict x = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for(size_t j = 0; j < cols; j++){
+            d[j] -= x[j];
         }
     }
 }
 
 // Scale the matrix, X = A*X
-void mat_scale(Mat dst, float a){
-    for(size_t i = 0; i < dst.rows; i++){
-        for(size_t j = 0; j < dst.cols; j++){
-            MAT_AT(dst,i,j) *= a;
+MAT_SIMD void mat_scale(Mat dst, float a){
+    size_t rows = dst.rows, cols = dst.cols;
+    if (mat_flat(dst)) { cols *= rows; rows = 1; }
+    for(size_t i = 0; i < rows; i++){
+        float *restrict d = &MAT_AT(dst, i, 0);
+        #pragma omp simd
+        for(size_t j = 0; j < cols; j++){
+            d[j] *= a;
         }
     }
 }
@@ -141,29 +217,153 @@ float dsigmoidf(float x) {
 // Applies sigmoid function to all indicies of a matrix
 void mat_sig(Mat m)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = sigmoidf(MAT_AT(m, i, j));
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            x[j] = sigmoidf(x[j]);
         }
     }
 }
 
 // Applies the derivative of sigmoid function to all indicies of a matrix
 void mat_dsig(Mat m) {
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            float sig = sigmoidf(x[j]);
+            x[j] = sig * (1.0f - sig);
+        }
+    }
+}
+
+// Applies a numerically stable softmax to each row of a matrix
+void mat_softmax(Mat m) {
     for (size_t i = 0; i < m.rows; ++i) {
+        float *row = &MAT_AT(m, i, 0);
+
+        // Shift by the row max so expf never overflows
+        float max = row[0];
+        for (size_t j = 1; j < m.cols; ++j) {
+            max = row[j] > max ? row[j] : max;
+        }
+
+        float sum = 0.0f;
         for (size_t j = 0; j < m.cols; ++j) {
-            float sig = sigmoidf(MAT_AT(m, i, j));
-            MAT_AT(m, i, j) = sig * (1.0f - sig);
+            row[j] = expf(row[j] - max);
+            sum += row[j];
+        }
+
+        float inv = 1.0f / sum;
+        for (size_t j = 0; j < m.cols; ++j) {
+            row[j] *= inv;
         }
     }
 }
 
 // Free the memory of a matrix
 void mat_free(Mat m) {
+    if (m.es) atomic_fetch_add_explicit(&stat_frees, 1, memory_order_relaxed);
     free(m.es);
     m.es = NULL;
 }
 
+#define ARENA_ALIGN 64
+
+// Header in front of every spilled block, padded so the block stays aligned
+typedef struct{
+    _Alignas(ARENA_ALIGN) void *next;
+    size_t index; // spill_count when it was taken
+    size_t bytes;
+}ArenaSpill;
+
+static size_t arena_round(size_t bytes) {
+    return (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// An arena with room for capacity bytes before it spills, 0 starts empty and sizes itself
+Arena arena_alloc(size_t capacity) {
+    Arena arena = {0};
+    arena.capacity = arena_round(capacity);
+    if (arena.capacity > 0) {
+        arena.base = aligned_alloc(ARENA_ALIGN, arena.capacity);
+        assert(arena.base != NULL);
+    }
+    return arena;
+}
+
+void arena_free(Arena *arena) {
+    arena->peak = 0;
+    arena_reset(arena, (ArenaMark){0, 0});
+    free(arena->base);
+    *arena = (Arena){0};
+}
+
+// Uninitialized, 64 bytes aligned memory that lives until the arena is reset below it
+void *arena_push(Arena *arena, size_t bytes) {
+    bytes = arena_round(bytes);
+    void *p;
+    if (arena->used + bytes <= arena->capacity) {
+        p = arena->base + arena->used;
+        arena->used += bytes;
+    } else {
+        ArenaSpill *spill = aligned_alloc(ARENA_ALIGN, sizeof(ArenaSpill) + bytes);
+        assert(spill != NULL);
+        spill->next = arena->spills;
+        spill->index = arena->spill_count++;
+        spill->bytes = bytes;
+        arena->spills = spill;
+        arena->spill_bytes += bytes;
+        p = spill + 1;
+    }
+    if (arena->used + arena->spill_bytes > arena->peak) arena->peak = arena->used + arena->spill_bytes;
+    return p;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    return (ArenaMark){ arena->used, arena->spill_count };
+}
+
+// Drop everything pushed since mark, a reset to the empty mark also grows the region to the peak
+void arena_reset(Arena *arena, ArenaMark mark) {
+    while (arena->spills && ((ArenaSpill *)arena->spills)->index >= mark.spill_count) {
+        ArenaSpill *spill = arena->spills;
+        arena->spills = spill->next;
+        arena->spill_bytes -= spill->bytes;
+        free(spill);
+    }
+    arena->spill_count = mark.spill_count;
+    arena->used = mark.used;
+
+    if (mark.used == 0 && mark.spill_count == 0 && arena->peak > arena->capacity) {
+        free(arena->base);
+        arena->capacity = arena->peak;
+        arena->base = aligned_alloc(ARENA_ALIGN, arena->capacity);
+        assert(arena->base != NULL);
+    }
+}
+
+// Per thread arena for temporaries of the library, every user resets it to the mark it took
+Arena *mat_scratch(void) {
+    static _Thread_local Arena scratch;
+    return &scratch;
+}
+
+// Matrix in an arena, uninitialized, must not be passed to mat_free
+Mat mat_alloc_in(Arena *arena, size_t rows, size_t cols) {
+    Mat m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.es = arena_push(arena, rows * cols * sizeof(*m.es));
+    return m;
+}
+
 // Red hot chili pepper ass name
 Mat one_hot_encode(int label, int num_classes) {
     Mat encoded = mat_alloc(1, num_classes);
@@ -182,18 +382,117 @@ float drelu(float x) {
     return x > 0 ? 1 : 0;
 }
 
-void mat_relu(Mat m) {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = reluf(MAT_AT(m, i, j));
+MAT_SIMD void mat_relu(Mat m) {
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            x[j] = reluf(x[j]);
         }
     }
 }
 
 void mat_drelu(Mat m) {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = drelu(MAT_AT(m, i, j));
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            x[j] = drelu(x[j]);
+        }
+    }
+}
+
+MAT_SIMD void mat_leaky_relu(Mat m) {
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            x[j] = x[j] > 0 ? x[j] : LEAKY_RELU_ALPHA * x[j];
+        }
+    }
+}
+
+void mat_tanh(Mat m) {
+    size_t rows = m.rows, cols = m.cols;
+    if (mat_flat(m)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict x = &MAT_AT(m, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            x[j] = tanhf(x[j]);
+        }
+    }
+}
+
+// The *_grad kernels multiply delta by the derivative, taken from the activation output a
+// so the pre-activation never has to be stored
+
+// delta *= a * (1 - a)
+MAT_SIMD void mat_sig_grad(Mat delta, Mat a) {
+    assert(delta.rows == a.rows);
+    assert(delta.cols == a.cols);
+    size_t rows = delta.rows, cols = delta.cols;
+    if (mat_flat(delta) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict d = &MAT_AT(delta, i, 0);
+        const float *restrict y = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            d[j] *= y[j] * (1.0f - y[j]);
+        }
+    }
+}
+
+// delta *= a > 0
+MAT_SIMD void mat_relu_grad(Mat delta, Mat a) {
+    assert(delta.rows == a.rows);
+    assert(delta.cols == a.cols);
+    size_t rows = delta.rows, cols = delta.cols;
+    if (mat_flat(delta) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict d = &MAT_AT(delta, i, 0);
+        const float *restrict y = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            d[j] = y[j] > 0 ? d[j] : 0.0f;
+        }
+    }
+}
+
+// delta *= a > 0 ? 1 : alpha
+MAT_SIMD void mat_leaky_relu_grad(Mat delta, Mat a) {
+    assert(delta.rows == a.rows);
+    assert(delta.cols == a.cols);
+    size_t rows = delta.rows, cols = delta.cols;
+    if (mat_flat(delta) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict d = &MAT_AT(delta, i, 0);
+        const float *restrict y = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            d[j] *= y[j] > 0 ? 1.0f : LEAKY_RELU_ALPHA;
+        }
+    }
+}
+
+// delta *= 1 - a^2
+MAT_SIMD void mat_tanh_grad(Mat delta, Mat a) {
+    assert(delta.rows == a.rows);
+    assert(delta.cols == a.cols);
+    size_t rows = delta.rows, cols = delta.cols;
+    if (mat_flat(delta) && mat_flat(a)) { cols *= rows; rows = 1; }
+    for (size_t i = 0; i < rows; ++i) {
+        float *restrict d = &MAT_AT(delta, i, 0);
+        const float *restrict y = &MAT_AT(a, i, 0);
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            d[j] *= 1.0f - y[j] * y[j];
         }
     }
 }
@@ -0,0 +1,192 @@
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct{
+    char name[64];
+    char help[128];
+    char labels[64]; // e.g. layer="0", empty for none
+    MetricType type;
+    double value;
+}Metric;
+
+static Metric metrics[METRICS_MAX];
+static int metric_count = 0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int server_fd = -1;
+static pthread_t server_thread;
+static atomic_int server_stopping = 0;
+
+// Add a metric and return its id, metrics sharing a name must be registered one after the other
+int metrics_register(const char *name, const char *help, MetricType type, const char *labels) {
+    pthread_mutex_lock(&metrics_lock);
+    if (metric_count == METRICS_MAX) {
+        pthread_mutex_unlock(&metrics_lock);
+        fprintf(stderr, "Too many metrics, %s not registered.\n", name);
+        return -1;
+    }
+    int id = metric_count++;
+    Metric *m = &metrics[id];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    snprintf(m->help, sizeof(m->help), "%s", help);
+    snprintf(m->labels, sizeof(m->labels), "%s", labels ? labels : "");
+    m->type = type;
+    m->value = 0;
+    pthread_mutex_unlock(&metrics_lock);
+    return id;
+}
+
+void metrics_set(int id, double value) {
+    if (id < 0) return;
+    pthread_mutex_lock(&metrics_lock);
+    metrics[id].value = value;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_add(int id, double value) {
+    if (id < 0) return;
+    pthread_mutex_lock(&metrics_lock);
+    metrics[id].value += value;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Every metric in the text exposition format, HELP and TYPE once per name
+void metrics_write(FILE *out) {
+    pthread_mutex_lock(&metrics_lock);
+    for (int i = 0; i < metric_count; i++) {
+        Metric *m = &metrics[i];
+        if (i == 0 || strcmp(m->name, metrics[i - 1].name) != 0) {
+            fprintf(out, "# HELP %s %s\n", m->name, m->help);
+            fprintf(out, "# TYPE %s %s\n", m->name, m->type == METRIC_COUNTER ? "counter" : "gauge");
+        }
+        if (m->labels[0]) {
+            fprintf(out, "%s{%s} %.17g\n", m->name, m->labels, m->value);
+        } else {
+            fprintf(out, "%s %.17g\n", m->name, m->value);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Write to a temporary file and rename it over filename, so readers never see half a file
+int metrics_write_file(const char *filename) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    FILE *file = fopen(tmp, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s for writing metrics.\n", tmp);
+        return -1;
+    }
+    metrics_write(file);
+    if (fclose(file) != 0 || rename(tmp, filename) != 0) {
+        fprintf(stderr, "Failed to write metrics to %s.\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Send all of buf, MSG_NOSIGNAL so a scraper that hung up can't kill the process with SIGPIPE
+static int send_full(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Answer every connection with the current metrics, whatever was asked
+static void *metrics_server(void *arg) {
+    (void)arg;
+    for (;;) {
+        int client = accept(server_fd, NULL, NULL);
+        if (client < 0) {
+            if (atomic_load(&server_stopping)) break; // listening socket was shut down
+            continue; // EINTR, ECONNABORTED and the like only lose that one connection
+        }
+
+        // One thread serves every scrape, a client that never sends or never reads must not stall the rest
+        struct timeval timeout = { METRICS_CLIENT_TIMEOUT, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char request[1024];
+        if (read(client, request, sizeof(request)) <= 0) { // an error, a timeout or the client already closed
+            close(client);
+            continue;
+        }
+
+        char *body = NULL;
+        size_t body_size = 0;
+        FILE *stream = open_memstream(&body, &body_size);
+        if (stream) {
+            metrics_write(stream);
+            fclose(stream);
+
+            char header[256];
+            int header_size = snprintf(header, sizeof(header),
+                                       "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                                       body_size);
+            if (send_full(client, header, header_size) != 0 || send_full(client, body, body_size) != 0) {
+                fprintf(stderr, "Failed to send metrics.\n");
+            }
+            free(body);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+// Serve the metrics over HTTP on 127.0.0.1:port from a background thread
+int metrics_serve(int port) {
+    atomic_store(&server_stopping, 0);
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_fd, 8) < 0) {
+        perror("metrics server");
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&server_thread, NULL, metrics_server, NULL) != 0) {
+        fprintf(stderr, "Failed to start metrics server thread.\n");
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop serving, unblocks accept and waits for the thread
+void metrics_stop(void) {
+    if (server_fd < 0) return;
+    atomic_store(&server_stopping, 1);
+    shutdown(server_fd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(server_fd);
+    server_fd = -1;
+}
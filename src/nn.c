@@ -1,4 +1,30 @@
 #include "nn.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#define NN_PARAM_ROUND(n) (((n) + NN_PARAM_ALIGN - 1) / NN_PARAM_ALIGN * NN_PARAM_ALIGN)
+
+// Lay the weights and biases of every layer out in one zeroed slab, ws[i] then bs[i], each block aligned
+// Networks of the same architecture get the same layout, so gradients and optimizer state line up with it
+static void nn_alloc_params(NN *nn, const size_t *arch) {
+    size_t count = 0;
+    for (size_t i = 0; i < nn->size; i++) {
+        count += NN_PARAM_ROUND(arch[i] * arch[i + 1]) + NN_PARAM_ROUND(arch[i + 1]);
+    }
+    nn->param_count = count;
+    nn->params = aligned_alloc(NN_PARAM_ALIGN * sizeof(float), count * sizeof(float));
+    assert(nn->params != NULL);
+    memset(nn->params, 0, count * sizeof(float));
+
+    float *p = nn->params;
+    for (size_t i = 0; i < nn->size; i++) {
+        nn->ws[i] = (Mat){ .rows = arch[i], .cols = arch[i + 1], .stride = arch[i + 1], .es = p };
+        p += NN_PARAM_ROUND(arch[i] * arch[i + 1]);
+        nn->bs[i] = (Mat){ .rows = 1, .cols = arch[i + 1], .stride = arch[i + 1], .es = p };
+        p += NN_PARAM_ROUND(arch[i + 1]);
+    }
+}
 
 // Allocate memory for your neural network
 NN nn_alloc(size_t *arch, size_t arch_count){
@@ -7,6 +33,7 @@ NN nn_alloc(size_t *arch, size_t arch_count){
 
     NN nn;
     nn.size = arch_count - 1; // Number of layers excluding input layer
+    nn.kernel = 0;            // generic forward pass until nn_specialize
 
     nn.ws = calloc(nn.size, sizeof(*nn.ws));
     assert(nn.ws != NULL);
@@ -17,19 +44,104 @@ NN nn_alloc(size_t *arch, size_t arch_count){
     nn.as = calloc(nn.size + 1, sizeof(*nn.as));
     assert(nn.as != NULL);
 
-    // Input
-    nn.as[0] = mat_alloc(1, arch[0]);
+    // Sigmoid hidden layers and a softmax output by default
+    nn.acts = calloc(nn.size, sizeof(*nn.acts));
+    assert(nn.acts != NULL);
+    for(size_t i = 0; i < nn.size; i++){
+        nn.acts[i] = (i + 1 < nn.size) ? ACT_SIGMOID : ACT_SOFTMAX;
+    }
+
+    // Weights and biases are views into the parameter slab
+    nn_alloc_params(&nn, arch);
 
-    // Allocate all layers progressively 1 to nn.size
-    for(size_t i = 1; i < nn.size + 1; i++){
-        nn.ws[i-1] = mat_alloc(nn.as[i-1].cols, arch[i]);
-        nn.bs[i-1] = mat_alloc(1, arch[i]);
-        nn.as[i]   = mat_alloc(1, arch[i]);
+    // Activations of every layer, input first
+    for(size_t i = 0; i < nn.size + 1; i++){
+        nn.as[i] = mat_alloc(1, arch[i]);
     }
 
     return nn;
 }
 
+// The whole parameter slab as a single row, padding included, for passes that treat every parameter alike
+Mat nn_params(NN nn){
+    return (Mat){ .rows = 1, .cols = nn.param_count, .stride = nn.param_count, .es = nn.params };
+}
+
+// Weights then biases of one layer as a single row of the slab, padding included
+// Layers are back to back in the slab, so the segments of all layers tile nn_params exactly
+Mat nn_layer_params(NN nn, size_t layer){
+    assert(layer < nn.size);
+    float *end = layer + 1 < nn.size ? nn.ws[layer + 1].es : nn.params + nn.param_count;
+    size_t count = end - nn.ws[layer].es;
+    return (Mat){ .rows = 1, .cols = count, .stride = count, .es = nn.ws[layer].es };
+}
+
+// Allocate a zeroed network with the same shape and activations, used for gradients and optimizer state
+NN nn_alloc_like(NN nn){
+    size_t *arch = malloc((nn.size + 1) * sizeof(*arch));
+    assert(arch != NULL);
+
+    arch[0] = nn.ws[0].rows;
+    for(size_t i = 0; i < nn.size; i++){
+        arch[i + 1] = nn.ws[i].cols;
+    }
+
+    NN like = nn_alloc(arch, nn.size + 1);
+    memcpy(like.acts, nn.acts, nn.size * sizeof(*nn.acts));
+    free(arch);
+    return like;
+}
+
+// Allocate activations for batch_size samples that share the weights of nn
+// The result can run nn_forward on a whole batch and is released with nn_batch_free
+NN nn_batch_alloc(NN nn, size_t batch_size){
+    assert(batch_size > 0);
+
+    NN batch = nn;
+    batch.as = calloc(nn.size + 1, sizeof(*batch.as));
+    assert(batch.as != NULL);
+
+    for(size_t i = 0; i < nn.size + 1; i++){
+        batch.as[i] = mat_alloc(batch_size, nn.as[i].cols);
+    }
+    return batch;
+}
+
+// Same as nn_batch_alloc with the activations in an arena, released by resetting the arena
+NN nn_batch_alloc_in(Arena *arena, NN nn, size_t batch_size){
+    assert(batch_size > 0);
+
+    NN batch = nn;
+    batch.as = arena_push(arena, (nn.size + 1) * sizeof(*batch.as));
+    for(size_t i = 0; i < nn.size + 1; i++){
+        batch.as[i] = mat_alloc_in(arena, batch_size, nn.as[i].cols);
+    }
+    return batch;
+}
+
+// Free only what nn_batch_alloc allocated, the weights belong to the original network
+void nn_batch_free(NN batch){
+    for(size_t i = 0; i < batch.size + 1; i++){
+        mat_free(batch.as[i]);
+    }
+    free(batch.as);
+}
+
+// Set how many rows of a batch context nn_forward computes, at most the batch_size it was allocated with
+void nn_batch_rows(NN batch, size_t rows){
+    for(size_t i = 0; i < batch.size + 1; i++){
+        batch.as[i].rows = rows;
+    }
+}
+
+// Copy the weights and biases of src into dst, both must have the same shape
+void nn_copy(NN dst, NN src){
+    assert(dst.size == src.size);
+    assert(dst.param_count == src.param_count);
+    memcpy(dst.params, src.params, src.param_count * sizeof(float));
+    memcpy(dst.acts, src.acts, src.size * sizeof(*src.acts));
+}
+
 // Randomize the weights and biases
 void nn_rand(NN nn, float low, float high){
     
@@ -39,309 +151,548 @@ void nn_rand(NN nn, float low, float high){
     }
 }
 
+// Choose the activation of a layer, layer 0 is the first hidden layer
+void nn_set_activation(NN nn, size_t layer, Activation act){
+    assert(layer < nn.size);
+    assert(act < ACT_COUNT);
+    assert(act != ACT_SOFTMAX || layer + 1 == nn.size); // softmax only on the output
+    nn.acts[layer] = act;
+}
+
+// Lookup tables generated from NN_ACTIVATIONS, indexed by activation id
+#define NN_ACT_NAME(id, name, fwd, grad) [id] = name,
+#define NN_ACT_FORWARD(id, name, fwd, grad) [id] = fwd,
+#define NN_ACT_GRAD(id, name, fwd, grad) [id] = grad,
+static const char *const nn_act_names[ACT_COUNT] = { NN_ACTIVATIONS(NN_ACT_NAME) };
+static void (*const nn_act_forwards[ACT_COUNT])(Mat) = { NN_ACTIVATIONS(NN_ACT_FORWARD) };
+static void (*const nn_act_grads[ACT_COUNT])(Mat, Mat) = { NN_ACTIVATIONS(NN_ACT_GRAD) };
+#undef NN_ACT_NAME
+#undef NN_ACT_FORWARD
+#undef NN_ACT_GRAD
+
+const char *nn_activation_name(Activation act){
+    return act < ACT_COUNT ? nn_act_names[act] : "unknown";
+}
+
+// Multiply delta by the activation derivative, a is the layer output
+static void nn_act_backward(Activation act, Mat delta, Mat a){
+    assert(nn_act_grads[act] != NULL && "activation has no gradient kernel");
+    nn_act_grads[act](delta, a);
+}
+
+// dst = a*w + b with the dimensions known at compile time, always inlined into the NN_FIXED_SHAPES kernels
+// The loop over k is unrolled by 4 so every row of dst is loaded and stored once per 4 rows of w, the sums
+// still run in the order of mat_dot followed by mat_sum_row, so the output is the same to the bit
+static inline __attribute__((always_inline))
+void nn_fixed_affine(Mat dst, Mat a, Mat w, Mat b, const size_t n_in, const size_t n_out){
+    assert(a.cols == n_in && w.rows == n_in && w.cols == n_out && w.stride == n_out);
+    assert(dst.cols == n_out && dst.rows == a.rows);
+
+    const float *restrict bias = b.es;
+    for(size_t r = 0; r < dst.rows; r++){
+        const float *restrict x = &MAT_AT(a, r, 0);
+        float *restrict d = &MAT_AT(dst, r, 0);
+        for(size_t j = 0; j < n_out; j++) d[j] = 0;
+
+        size_t k = 0;
+        for(; k + 4 <= n_in; k += 4){
+            const float *restrict w0 = w.es + k * n_out;
+            const float *restrict w1 = w0 + n_out;
+            const float *restrict w2 = w1 + n_out;
+            const float *restrict w3 = w2 + n_out;
+            float x0 = x[k], x1 = x[k + 1], x2 = x[k + 2], x3 = x[k + 3];
+            #pragma omp simd
+            for(size_t j = 0; j < n_out; j++){
+                d[j] = d[j] + x0 * w0[j] + x1 * w1[j] + x2 * w2[j] + x3 * w3[j];
+            }
+        }
+        for(; k < n_in; k++){
+            const float *restrict wk = w.es + k * n_out;
+            float xk = x[k];
+            #pragma omp simd
+            for(size_t j = 0; j < n_out; j++){
+                d[j] += xk * wk[j];
+            }
+        }
+
+        #pragma omp simd
+        for(size_t j = 0; j < n_out; j++){
+            d[j] += bias[j];
+        }
+    }
+}
+
+// One affine function per layer of every NN_FIXED_SHAPES entry, the constants become the trip counts
+typedef void (*NNAffine)(Mat dst, Mat a, Mat w, Mat b);
+typedef struct{
+    size_t arch[3];
+    NNAffine layers[2];
+}NNFixed;
+
+#define NN_FIXED_KERNELS(in, hidden, out) \
+    MAT_SIMD static void nn_affine_##in##_##hidden(Mat dst, Mat a, Mat w, Mat b){ nn_fixed_affine(dst, a, w, b, in, hidden); } \
+    MAT_SIMD static void nn_affine_##in##_##hidden##_##out(Mat dst, Mat a, Mat w, Mat b){ nn_fixed_affine(dst, a, w, b, hidden, out); }
+#define NN_FIXED_ENTRY(in, hidden, out) { { in, hidden, out }, { nn_affine_##in##_##hidden, nn_affine_##in##_##hidden##_##out } },
+NN_FIXED_SHAPES(NN_FIXED_KERNELS)
+static const NNFixed nn_fixed[] = { NN_FIXED_SHAPES(NN_FIXED_ENTRY) };
+#undef NN_FIXED_KERNELS
+#undef NN_FIXED_ENTRY
+
+// Use the specialized forward pass when the shape of nn is one of NN_FIXED_SHAPES
+// Batch contexts made from nn afterwards inherit the choice
+void nn_specialize(NN *nn){
+    nn->kernel = 0;
+    if(nn->size != 2) return;
+    for(size_t i = 0; i < sizeof(nn_fixed) / sizeof(nn_fixed[0]); i++){
+        if(nn->ws[0].rows == nn_fixed[i].arch[0] && nn->ws[0].cols == nn_fixed[i].arch[1] &&
+           nn->ws[1].cols == nn_fixed[i].arch[2]){
+            nn->kernel = i + 1;
+            return;
+        }
+    }
+}
+
 // Input to Output
 void nn_forward(NN nn){
+    PROF_TRACE_SAMPLE(traced);
+    PROF_TRACE_BEGIN(tr_forward, traced);
     for(size_t i = 0; i < nn.size; i++){
-        mat_dot(nn.as[i+1], nn.as[i], nn.ws[i]);
-        mat_sum(nn.as[i+1], nn.bs[i]);
-        mat_sig(nn.as[i+1]);
+        PROF_BEGIN(t_layer);
+        PROF_TRACE_BEGIN(tr_layer, traced);
+        if(nn.kernel){
+            nn_fixed[nn.kernel - 1].layers[i](nn.as[i+1], nn.as[i], nn.ws[i], nn.bs[i]);
+        }else{
+            mat_dot(nn.as[i+1], nn.as[i], nn.ws[i]);
+            mat_sum_row(nn.as[i+1], nn.bs[i]);
+        }
+        nn_act_forwards[nn.acts[i]](nn.as[i+1]);
+        PROF_TRACE_END(tr_layer, "forward_layer", (int)i);
+        PROF_END(t_layer, PROF_LAYER_FORWARD(i));
     }
+    PROF_TRACE_END(tr_forward, "nn_forward", -1);
 }
 
-// compute the cost, mse
+// Cross-entropy of the current output against a class label, forward pass must be done before
+float nn_cross_entropy(NN nn, int label){
+    assert(label >= 0 && (size_t)label < NN_OUTPUT(nn).cols);
+
+    // Clamp so a saturated softmax doesn't give log(0)
+    return -logf(fmaxf(MAT_AT(NN_OUTPUT(nn), 0, label), NN_LOG_EPS));
+}
+
+// Batch size of the forward passes of nn_cost
+#define NN_COST_BATCH 64
+
+// compute the cost, cross-entropy
+// Rows are run NN_COST_BATCH at a time on a scratch context reading training_input in place,
+// the activations of nn are left untouched
 float nn_cost(NN nn, Mat training_input, Mat training_output){
     assert(training_input.rows == training_output.rows);
+    assert(training_input.cols == nn.as[0].cols);
     assert(training_output.cols == nn.as[nn.size].cols);
 
-    float cost = 0;
-    for(size_t i = 0; i < training_input.rows; i++){
-        Mat x = mat_row(training_input, i);
-        Mat y = mat_row(training_output, i);
-
-        mat_copy(nn.as[0], x);
-        nn_forward(nn);
+    Arena *scratch = mat_scratch();
+    ArenaMark mark = arena_mark(scratch);
+    NN batch = nn_batch_alloc_in(scratch, nn, NN_COST_BATCH);
 
-        for(size_t j = 0; j < training_output.cols; j++){
-            float d = MAT_AT(nn.as[nn.size], 0, j) - MAT_AT(y, 0, j);
-            cost += d*d;
+    float cost = 0;
+    for(size_t start = 0; start < training_input.rows; start += NN_COST_BATCH){
+        size_t n = training_input.rows - start < NN_COST_BATCH ? training_input.rows - start : NN_COST_BATCH;
+        nn_batch_rows(batch, n);
+        nn_set_input(batch, mat_rows(training_input, start, n));
+        nn_forward(batch);
+
+        for(size_t r = 0; r < n; r++){
+            for(size_t j = 0; j < training_output.cols; j++){
+                float p = fmaxf(MAT_AT(NN_OUTPUT(batch), r, j), NN_LOG_EPS);
+                cost -= MAT_AT(training_output, start + r, j)*logf(p);
+            }
         }
     }
+
+    arena_reset(scratch, mark);
     return (cost/training_input.rows);
 }
 
-// Magik
-void nn_backprop(NN nn, Mat training_input, Mat training_output, float learning_rate) {
+static void nn_backprop_delta(NN nn, NN g, Mat delta, Arena *scratch, NNLayerHook hook, void *ctx);
+
+// Magik, accumulates the gradient of one sample into g without touching the parameters
+void nn_backprop(NN nn, NN g, Mat training_input, Mat training_output) {
     assert(training_input.cols == nn.as[0].cols);
     assert(training_output.cols == nn.as[nn.size].cols);
 
     // Forward pass already done before calling backprop
-    // Initialize delta for the output layer
-    Mat delta = mat_alloc(1, nn.as[nn.size].cols);
+    // Softmax (or sigmoid) + cross-entropy collapse to delta = a_L - y for the output layer
+    Arena *scratch = mat_scratch();
+    ArenaMark mark = arena_mark(scratch);
+    Mat delta = mat_alloc_in(scratch, 1, nn.as[nn.size].cols);
+    mat_copy(delta, NN_OUTPUT(nn));
+    mat_subtract(delta, training_output);
+
+    nn_backprop_delta(nn, g, delta, scratch, NULL, NULL);
+    arena_reset(scratch, mark);
+}
 
-    // Compute delta for the output layer: (a_L - y) * sigmoid'(z_L)
-    for (size_t j = 0; j < nn.as[nn.size].cols; ++j) {
-        float a = MAT_AT(nn.as[nn.size], 0, j);
-        float y = MAT_AT(training_output, 0, j);
-        float dsig = a * (1.0f - a); // Since sigmoid'(z) = a * (1 - a)
-        MAT_AT(delta, 0, j) = (a - y) * dsig;
-    }
+static void nn_backprop_label_hook(NN nn, NN g, int label, NNLayerHook hook, void *ctx);
+
+// Same as nn_backprop but takes the class label, so no one-hot target is needed
+void nn_backprop_label(NN nn, NN g, int label) {
+    nn_backprop_label_hook(nn, g, label, NULL, NULL);
+}
+
+static void nn_backprop_label_hook(NN nn, NN g, int label, NNLayerHook hook, void *ctx) {
+    assert(label >= 0 && (size_t)label < NN_OUTPUT(nn).cols);
+
+    // delta = a_L - one_hot(label), subtracting the 1 in place
+    Arena *scratch = mat_scratch();
+    ArenaMark mark = arena_mark(scratch);
+    Mat delta = mat_alloc_in(scratch, 1, nn.as[nn.size].cols);
+    mat_copy(delta, NN_OUTPUT(nn));
+    MAT_AT(delta, 0, label) -= 1.0f;
+
+    nn_backprop_delta(nn, g, delta, scratch, hook, ctx);
+    arena_reset(scratch, mark);
+}
+
+// Propagate the output delta through every layer into the gradients g
+// The deltas of the hidden layers are pushed on scratch, the caller resets it
+static void nn_backprop_delta(NN nn, NN g, Mat delta, Arena *scratch, NNLayerHook hook, void *ctx) {
+    // The fused output delta only holds for an output that pairs with the cross-entropy
+    assert(nn.acts[nn.size - 1] == ACT_SOFTMAX || nn.acts[nn.size - 1] == ACT_SIGMOID);
+    assert(g.size == nn.size);
+
+    PROF_TRACE_SAMPLE(traced);
+    PROF_TRACE_BEGIN(tr_backprop, traced);
 
     // Iterate backward through the layers
     for (size_t l = nn.size; l > 0; --l) {
-        // Compute gradients for weights and biases
-        // Gradient w.r. to weights: a_(l-1)^T * delta_l
+        PROF_BEGIN(t_layer);
+        PROF_TRACE_BEGIN(tr_layer, traced);
         Mat a_prev = nn.as[l - 1];
         Mat delta_l = delta;
 
-        // Allocate gradient matrices
-        Mat grad_w = mat_alloc(a_prev.cols, nn.ws[l - 1].cols);
-        Mat grad_b = mat_alloc(1, nn.bs[l - 1].cols);
-
-        // Compute grad_w
-        // Transpose a_prev and multiply by delta_l
-        // Since a_prev is 1 x n, delta_l is 1 x m, grad_w will be n x m
+        // Accumulate the gradient w.r. to weights: a_(l-1)^T * delta_l
+        // Since a_prev is 1 x n, delta_l is 1 x m, the gradient is n x m
         for (size_t i = 0; i < a_prev.cols; i++) {
+            float a = MAT_AT(a_prev, 0, i);
             for (size_t j = 0; j < delta_l.cols; j++) {
-                MAT_AT(grad_w, i, j) = MAT_AT(a_prev, 0, i) * MAT_AT(delta_l, 0, j);
+                MAT_AT(g.ws[l - 1], i, j) += a * MAT_AT(delta_l, 0, j);
             }
         }
 
-        // Compute grad_b (same as delta_l)
-        mat_copy(grad_b, delta_l);
-
-        // Update weights and biases: W = W - learning_rate * grad_w
-        //                           b = b - learning_rate * grad_b
-        for (size_t i = 0; i < nn.ws[l - 1].rows; i++) {
-            for (size_t j = 0; j < nn.ws[l - 1].cols; j++) {
-                MAT_AT(nn.ws[l - 1], i, j) -= learning_rate * MAT_AT(grad_w, i, j);
-            }
-        }
+        // Gradient w.r. to biases is delta_l
+        mat_sum(g.bs[l - 1], delta_l);
 
-        for (size_t j = 0; j < nn.bs[l - 1].cols; j++) {
-            MAT_AT(nn.bs[l - 1], 0, j) -= learning_rate * MAT_AT(grad_b, 0, j);
-        }
+        // Nothing below touches the gradients of this layer again, e.g. they can go on the wire now
+        if (hook) hook(ctx, l - 1);
 
         // Compute delta for the previous layer if not at the input layer
         if (l > 1) {
-            // delta_prev = (delta_l * W_l^T) .* sigmoid'(z_(l-1))
-            Mat w_transpose = mat_alloc(nn.ws[l - 1].cols, nn.ws[l - 1].rows);
-            // Transpose weights
-            for (size_t i = 0; i < nn.ws[l - 1].rows; i++) {
-                for (size_t j = 0; j < nn.ws[l - 1].cols; j++) {
-                    MAT_AT(w_transpose, j, i) = MAT_AT(nn.ws[l - 1], i, j);
-                }
-            }
-
-            // delta_prev = delta_l * W_l^T
-            Mat delta_prev = mat_alloc(1, nn.ws[l - 1].rows);
+            // delta_prev = (delta_l * W_l^T) .* f'(z_(l-1)), reading W row by row instead of transposing it
+            Mat delta_prev = mat_alloc_in(scratch, 1, nn.ws[l - 1].rows);
             for (size_t i = 0; i < delta_prev.cols; i++) {
-                MAT_AT(delta_prev, 0, i) = 0.0f;
+                float sum = 0.0f;
                 for (size_t j = 0; j < delta_l.cols; j++) {
-                    MAT_AT(delta_prev, 0, i) += MAT_AT(delta_l, 0, j) * MAT_AT(w_transpose, j, i);
+                    sum += MAT_AT(delta_l, 0, j) * MAT_AT(nn.ws[l - 1], i, j);
                 }
+                MAT_AT(delta_prev, 0, i) = sum;
             }
 
-            // Apply sigmoid derivative
-            mat_dsig(nn.as[l - 1]);
-            for (size_t i = 0; i < delta_prev.cols; i++) {
-                MAT_AT(delta_prev, 0, i) *= MAT_AT(nn.as[l - 1], 0, i);
-            }
+            // Apply the derivative of the activation that produced a_(l-1)
+            nn_act_backward(nn.acts[l - 2], delta_prev, nn.as[l - 1]);
 
-            // Free previous delta and set new delta
-            mat_free(delta);
-            mat_free(w_transpose);
             delta = delta_prev;
         }
-
-        // Free gradients
-        mat_free(grad_w);
-        mat_free(grad_b);
+        PROF_TRACE_END(tr_layer, "backprop_layer", (int)(l - 1));
+        PROF_END(t_layer, PROF_LAYER_BACKWARD(l - 1));
     }
+    PROF_TRACE_END(tr_backprop, "nn_backprop", -1);
+}
 
-    // Free the final delta
-    mat_free(delta);
+// Forward pass, cost and backprop of one image, accumulates its gradient into g and returns its cost
+float nn_train_sample(NN nn, NN g, Mat input, int label) {
+    return nn_train_sample_hook(nn, g, input, label, NULL, NULL);
+}
+
+// Same as nn_train_sample, calling hook(ctx, layer) once the gradients of each layer in g are final
+float nn_train_sample_hook(NN nn, NN g, Mat input, int label, NNLayerHook hook, void *ctx) {
+    // Layer 0 reads the sample where it lives, backprop reads it again for the first weight gradient
+    Mat own = nn_set_input(nn, input);
+
+    PROF_BEGIN(t_forward);
+    nn_forward(nn);
+    PROF_END(t_forward, PROF_FORWARD);
+
+    // Compute cost, cross-entropy straight from the label
+    PROF_BEGIN(t_cost);
+    float cost = nn_cross_entropy(nn, label);
+    PROF_END(t_cost, PROF_COST);
+
+    PROF_BEGIN(t_backprop);
+    nn_backprop_label_hook(nn, g, label, hook, ctx);
+    PROF_END(t_backprop, PROF_BACKPROP);
+
+    nn_set_input(nn, own);
+    return cost;
+}
+
+// Point layer 0 of nn at input instead of copying it into as[0], nn only reads it
+// Returns the matrix that was there, to be put back with another nn_set_input before nn_free
+Mat nn_set_input(NN nn, Mat input) {
+    assert(input.cols == nn.as[0].cols);
+    Mat previous = nn.as[0];
+    nn.as[0] = input;
+    return previous;
+}
+
+// Set every weight and bias to zero, used to reset gradient accumulators
+void nn_zero(NN nn) {
+    memset(nn.params, 0, nn.param_count * sizeof(float));
 }
 
 // Free the neural network memory
 void nn_free(NN nn) {
-    for (size_t i = 0; i < nn.size; ++i) {
-        mat_free(nn.ws[i]);
-        mat_free(nn.bs[i]);
-        mat_free(nn.as[i + 1]);
+    for (size_t i = 0; i < nn.size + 1; ++i) {
+        mat_free(nn.as[i]);
     }
+    free(nn.params);
     free(nn.ws);
     free(nn.bs);
     free(nn.as);
+    free(nn.acts);
 }
 
-// Save the configuration of the neural network
-void nn_save(NN nn, const char *filename) {
-    FILE *file = fopen(filename, "wb");
+// Save the configuration of the neural network, returns 0 on success and -1 on error
+// The file is written next to filename, flushed to disk and renamed over it, so a crash or a full
+// disk in the middle of a save leaves the previous version in place instead of a truncated file
+int nn_save(NN nn, const char *filename) {
+    char tmp_name[1024];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp.%ld", filename, (long)getpid());
+
+    FILE *file = fopen(tmp_name, "wb");
     if (!file) {
         fprintf(stderr, "Failed to open file for saving model.\n");
-        return;
+        return -1;
     }
 
-    // Save network size
-    fwrite(&nn.size, sizeof(size_t), 1, file);
+    // Save magic and network size
+    int ok = 1;
+    size_t magic = NN_FILE_MAGIC;
+    ok &= fwrite(&magic, sizeof(size_t), 1, file) == 1;
+    ok &= fwrite(&nn.size, sizeof(size_t), 1, file) == 1;
+
+    // Save the activation of every layer
+    for (size_t i = 0; i < nn.size; i++) {
+        unsigned int act = nn.acts[i];
+        ok &= fwrite(&act, sizeof(act), 1, file) == 1;
+    }
 
     // Save weights and biases
     for (size_t i = 0; i < nn.size; i++) {
-        fwrite(&nn.ws[i].rows, sizeof(size_t), 1, file);
-        fwrite(&nn.ws[i].cols, sizeof(size_t), 1, file);
-        fwrite(nn.ws[i].es, sizeof(float), nn.ws[i].rows * nn.ws[i].cols, file);
+        ok &= fwrite(&nn.ws[i].rows, sizeof(size_t), 1, file) == 1;
+        ok &= fwrite(&nn.ws[i].cols, sizeof(size_t), 1, file) == 1;
+        ok &= fwrite(nn.ws[i].es, sizeof(float), nn.ws[i].rows * nn.ws[i].cols, file) == nn.ws[i].rows * nn.ws[i].cols;
 
-        fwrite(&nn.bs[i].rows, sizeof(size_t), 1, file);
-        fwrite(&nn.bs[i].cols, sizeof(size_t), 1, file);
-        fwrite(nn.bs[i].es, sizeof(float), nn.bs[i].rows * nn.bs[i].cols, file);
+        ok &= fwrite(&nn.bs[i].rows, sizeof(size_t), 1, file) == 1;
+        ok &= fwrite(&nn.bs[i].cols, sizeof(size_t), 1, file) == 1;
+        ok &= fwrite(nn.bs[i].es, sizeof(float), nn.bs[i].rows * nn.bs[i].cols, file) == nn.bs[i].rows * nn.bs[i].cols;
     }
 
-    fclose(file);
+    // The data must be on disk before the rename makes it the model
+    ok &= fflush(file) == 0;
+    ok &= fsync(fileno(file)) == 0;
+    ok &= fclose(file) == 0;
+    if (!ok || rename(tmp_name, filename) != 0) {
+        fprintf(stderr, "Failed to save model to %s.\n", filename);
+        unlink(tmp_name);
+        return -1;
+    }
+
+    // And the rename itself must survive a crash
+    char dir_name[1024];
+    snprintf(dir_name, sizeof(dir_name), "%s", filename);
+    int dir = open(dirname(dir_name), O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+    return 0;
 }
 
-// Load the configuration currently saved
-NN nn_load(const char *filename) {
+// Largest network and layer nn_try_load accepts, anything bigger is a corrupt or half written file
+#define NN_LOAD_MAX_LAYERS 1024
+#define NN_LOAD_MAX_ELEMS ((size_t)1 << 28)
+
+// Load a saved network into out, returns 0 on success and -1 with a message on a missing or bad file
+// Unlike nn_load it never exits, so a long running process can retry on a file that is being rewritten
+int nn_try_load(const char *filename, NN *out) {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         fprintf(stderr, "Failed to open file for loading model.\n");
-        exit(1);
+        return -1;
     }
 
-    NN nn;
+    NN nn = {0};
+    size_t *arch = NULL;
 
-    // Load network size
+    // Load network size, files without the magic are from before activations were saved
+    int has_acts = 0;
     if (fread(&nn.size, sizeof(size_t), 1, file) != 1) {
         fprintf(stderr, "Failed to read network size.\n");
-        fclose(file);
-        exit(1);
+        goto fail;
     }
-
-    // Allocate memory for weights, biases, and activations
-    nn.ws = calloc(nn.size, sizeof(*nn.ws));
-    if (!nn.ws) {
-        fprintf(stderr, "Failed to allocate memory for weights.\n");
-        fclose(file);
-        exit(1);
+    if (nn.size == NN_FILE_MAGIC) {
+        has_acts = 1;
+        if (fread(&nn.size, sizeof(size_t), 1, file) != 1) {
+            fprintf(stderr, "Failed to read network size.\n");
+            goto fail;
+        }
+    }
+    if (nn.size == 0 || nn.size > NN_LOAD_MAX_LAYERS) {
+        fprintf(stderr, "Invalid network size %zu.\n", nn.size);
+        goto fail;
     }
 
+    // Allocate memory for weights, biases, activations and activation ids
+    nn.ws = calloc(nn.size, sizeof(*nn.ws));
     nn.bs = calloc(nn.size, sizeof(*nn.bs));
-    if (!nn.bs) {
-        fprintf(stderr, "Failed to allocate memory for biases.\n");
-        free(nn.ws);
-        fclose(file);
-        exit(1);
+    nn.as = calloc(nn.size + 1, sizeof(*nn.as));
+    nn.acts = calloc(nn.size, sizeof(*nn.acts));
+    arch = calloc(nn.size + 1, sizeof(*arch));
+    if (!nn.ws || !nn.bs || !nn.as || !nn.acts || !arch) {
+        fprintf(stderr, "Failed to allocate memory for the network.\n");
+        goto fail;
     }
 
-    nn.as = calloc(nn.size + 1, sizeof(*nn.as));
-    if (!nn.as) {
-        fprintf(stderr, "Failed to allocate memory for activations.\n");
-        free(nn.ws);
-        free(nn.bs);
-        fclose(file);
-        exit(1);
+    // Load activation ids, or fall back to sigmoid hidden layers and a softmax output
+    for (size_t i = 0; i < nn.size; i++) {
+        unsigned int act = (i + 1 < nn.size) ? ACT_SIGMOID : ACT_SOFTMAX;
+        if (has_acts && (fread(&act, sizeof(act), 1, file) != 1 || act >= ACT_COUNT)) {
+            fprintf(stderr, "Failed to read activation for layer %zu.\n", i);
+            goto fail;
+        }
+        nn.acts[i] = act;
     }
 
-    // Load weights and biases
+    // First pass over the layers for the dimensions, each layer must take the output of the previous one
+    long data_start = ftell(file);
     for (size_t i = 0; i < nn.size; i++) {
-        size_t rows, cols;
+        size_t w_rows, w_cols, b_rows, b_cols;
 
-        // Load weights dimensions
-        if (fread(&rows, sizeof(size_t), 1, file) != 1 ||
-            fread(&cols, sizeof(size_t), 1, file) != 1) {
+        if (fread(&w_rows, sizeof(size_t), 1, file) != 1 ||
+            fread(&w_cols, sizeof(size_t), 1, file) != 1) {
             fprintf(stderr, "Failed to read weight dimensions for layer %zu.\n", i);
-            // Free previously allocated memory before exiting
-            for (size_t j = 0; j < i; j++) {
-                mat_free(nn.ws[j]);
-                mat_free(nn.bs[j]);
-            }
-            free(nn.ws);
-            free(nn.bs);
-            free(nn.as);
-            fclose(file);
-            exit(1);
+            goto fail;
         }
-
-        // Allocate and load weights
-        nn.ws[i] = mat_alloc(rows, cols);
-        if (fread(nn.ws[i].es, sizeof(float), rows * cols, file) != rows * cols) {
-            fprintf(stderr, "Failed to read weight data for layer %zu.\n", i);
-            // Free previously allocated memory before exiting
-            for (size_t j = 0; j <= i; j++) {
-                mat_free(nn.ws[j]);
-                if (j < i) {
-                    mat_free(nn.bs[j]);
-                }
-            }
-            free(nn.ws);
-            free(nn.bs);
-            free(nn.as);
-            fclose(file);
-            exit(1);
+        if (w_rows == 0 || w_cols == 0 || w_rows > NN_LOAD_MAX_ELEMS / w_cols || (i > 0 && w_rows != arch[i])) {
+            fprintf(stderr, "Invalid weight dimensions %zux%zu for layer %zu.\n", w_rows, w_cols, i);
+            goto fail;
         }
+        arch[i] = w_rows;
+        arch[i + 1] = w_cols;
+        fseek(file, w_rows * w_cols * sizeof(float), SEEK_CUR);
 
-        // Load biases dimensions
-        if (fread(&rows, sizeof(size_t), 1, file) != 1 ||
-            fread(&cols, sizeof(size_t), 1, file) != 1) {
+        if (fread(&b_rows, sizeof(size_t), 1, file) != 1 ||
+            fread(&b_cols, sizeof(size_t), 1, file) != 1) {
             fprintf(stderr, "Failed to read bias dimensions for layer %zu.\n", i);
-            // Free previously allocated memory before exiting
-            for (size_t j = 0; j <= i; j++) {
-                mat_free(nn.ws[j]);
-                if (j < i) {
-                    mat_free(nn.bs[j]);
-                }
-            }
-            free(nn.ws);
-            free(nn.bs);
-            free(nn.as);
-            fclose(file);
-            exit(1);
+            goto fail;
+        }
+        if (b_rows != 1 || b_cols != w_cols) {
+            fprintf(stderr, "Invalid bias dimensions %zux%zu for layer %zu.\n", b_rows, b_cols, i);
+            goto fail;
         }
+        fseek(file, b_cols * sizeof(float), SEEK_CUR);
+    }
 
-        // Allocate and load biases
-        nn.bs[i] = mat_alloc(rows, cols);
-        if (fread(nn.bs[i].es, sizeof(float), rows * cols, file) != rows * cols) {
+    // Second pass reads the weights and biases straight into the parameter slab
+    nn_alloc_params(&nn, arch);
+    fseek(file, data_start, SEEK_SET);
+    for (size_t i = 0; i < nn.size; i++) {
+        size_t w_count = nn.ws[i].rows * nn.ws[i].cols;
+        fseek(file, 2 * sizeof(size_t), SEEK_CUR);
+        if (fread(nn.ws[i].es, sizeof(float), w_count, file) != w_count) {
+            fprintf(stderr, "Failed to read weight data for layer %zu.\n", i);
+            goto fail;
+        }
+        fseek(file, 2 * sizeof(size_t), SEEK_CUR);
+        if (fread(nn.bs[i].es, sizeof(float), nn.bs[i].cols, file) != nn.bs[i].cols) {
             fprintf(stderr, "Failed to read bias data for layer %zu.\n", i);
-            // Free previously allocated memory before exiting
-            for (size_t j = 0; j <= i; j++) {
-                mat_free(nn.ws[j]);
-                mat_free(nn.bs[j]);
-            }
-            free(nn.ws);
-            free(nn.bs);
-            free(nn.as);
-            fclose(file);
-            exit(1);
+            goto fail;
         }
     }
 
-    // Initialize activations
+    // Initialize activations, as[0] takes the input
     for (size_t i = 0; i < nn.size + 1; i++) {
-        size_t cols;
-        if (i == 0) {
-            cols = nn.ws[0].rows; // Input layer size
-        } else {
-            cols = nn.ws[i - 1].cols; // Current layer size
-        }
-        nn.as[i] = mat_alloc(1, cols);
+        nn.as[i] = mat_alloc(1, arch[i]);
     }
+    nn_specialize(&nn);
+
+    free(arch);
+    fclose(file);
+    *out = nn;
+    return 0;
 
+fail:
+    free(nn.params);
+    free(nn.ws);
+    free(nn.bs);
+    free(nn.as);
+    free(nn.acts);
+    free(arch);
     fclose(file);
+    return -1;
+}
+
+// Load the configuration currently saved
+NN nn_load(const char *filename) {
+    NN nn;
+    if (nn_try_load(filename, &nn) != 0) {
+        exit(1);
+    }
     return nn;
 }
 
+// Index of the highest activation in a row of the output layer
+int nn_argmax(NN nn, size_t row) {
+    float max_val = MAT_AT(NN_OUTPUT(nn), row, 0);
+    int predicted = 0;
+    for (size_t j = 1; j < NN_OUTPUT(nn).cols; j++) {
+        if (MAT_AT(NN_OUTPUT(nn), row, j) > max_val) {
+            max_val = MAT_AT(NN_OUTPUT(nn), row, j);
+            predicted = j;
+        }
+    }
+    return predicted;
+}
+
 // Predict the output for a given input
 int nn_predict(NN nn, Mat input) {
-    mat_copy(nn.as[0], input);
+    Mat own = nn_set_input(nn, input);
     nn_forward(nn);
+    nn_set_input(nn, own);
 
     // Find the index with the highest activation
-    float max_val = MAT_AT(nn.as[nn.size], 0, 0);
-    int predicted = 0;
-    for (size_t j = 1; j < nn.as[nn.size].cols; j++) {
-        if (MAT_AT(nn.as[nn.size], 0, j) > max_val) {
-            max_val = MAT_AT(nn.as[nn.size], 0, j);
-            predicted = j;
+    return nn_argmax(nn, 0);
+}
+
+// Predict the rows of inputs with a context from nn_batch_alloc, one forward pass per batch
+void nn_predict_batch(NN batch, Mat inputs, int *predicted) {
+    assert(inputs.cols == batch.as[0].cols);
+
+    size_t capacity = batch.as[0].rows;
+    for (size_t start = 0; start < inputs.rows; start += capacity) {
+        size_t n = inputs.rows - start < capacity ? inputs.rows - start : capacity;
+
+        // Shrink the activations to the last partial batch, layer 0 reads the rows of inputs in place
+        nn_batch_rows(batch, n);
+        Mat own = nn_set_input(batch, mat_view(&MAT_AT(inputs, start, 0), n, inputs.cols, inputs.stride));
+        nn_forward(batch);
+
+        for (size_t r = 0; r < n; r++) {
+            predicted[start + r] = nn_argmax(batch, r);
         }
+
+        nn_set_input(batch, own);
+        nn_batch_rows(batch, capacity);
     }
-    return predicted;
-}
\ No newline at end of file
+}
@@ -0,0 +1,132 @@
+#include "optim.h"
+
+// Every kernel does one pass over a parameter block: scale the accumulated gradient by 1/batch_size,
+// update the state, update the parameter and zero the gradient for the next batch
+
+MAT_SIMD static void sgd_update(float *restrict p, float *restrict g, size_t n, float lr, float scale) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        p[i] -= lr * scale * g[i];
+        g[i] = 0.0f;
+    }
+}
+
+// v = mu*v + g, p -= lr*v
+MAT_SIMD static void momentum_update(float *restrict p, float *restrict g, float *restrict v, size_t n,
+                            float lr, float scale, float mu) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        float vi = mu * v[i] + scale * g[i];
+        v[i] = vi;
+        p[i] -= lr * vi;
+        g[i] = 0.0f;
+    }
+}
+
+// v = mu*v + g, p -= lr*(g + mu*v), the look-ahead form that needs no extra parameter copy
+MAT_SIMD static void nesterov_update(float *restrict p, float *restrict g, float *restrict v, size_t n,
+                            float lr, float scale, float mu) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        float gi = scale * g[i];
+        float vi = mu * v[i] + gi;
+        v[i] = vi;
+        p[i] -= lr * (gi + mu * vi);
+        g[i] = 0.0f;
+    }
+}
+
+// v = b*v + (1-b)*g^2, p -= lr*g/(sqrt(v) + eps)
+MAT_SIMD static void rmsprop_update(float *restrict p, float *restrict g, float *restrict v, size_t n,
+                           float lr, float scale, float beta, float eps) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        float gi = scale * g[i];
+        float vi = beta * v[i] + (1.0f - beta) * gi * gi;
+        v[i] = vi;
+        p[i] -= lr * gi / (sqrtf(vi) + eps);
+        g[i] = 0.0f;
+    }
+}
+
+// m = b1*m + (1-b1)*g, v = b2*v + (1-b2)*g^2, p -= lr_t*m/(sqrt(v) + eps), lr_t carries the bias correction
+MAT_SIMD static void adam_update(float *restrict p, float *restrict g, float *restrict m, float *restrict v, size_t n,
+                        float lr_t, float scale, float beta1, float beta2, float eps) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        float gi = scale * g[i];
+        float mi = beta1 * m[i] + (1.0f - beta1) * gi;
+        float vi = beta2 * v[i] + (1.0f - beta2) * gi * gi;
+        m[i] = mi;
+        v[i] = vi;
+        p[i] -= lr_t * mi / (sqrtf(vi) + eps);
+        g[i] = 0.0f;
+    }
+}
+
+// Allocate the state the optimizer needs for nn, plain sgd needs none
+Optimizer optim_alloc(NN nn, OptimKind kind, float learning_rate) {
+    Optimizer opt = {0};
+    opt.kind = kind;
+    opt.learning_rate = learning_rate;
+    opt.beta1 = 0.9f;
+    opt.beta2 = (kind == OPTIM_RMSPROP) ? 0.9f : 0.999f;
+    opt.eps = 1e-8f;
+
+    if (kind != OPTIM_SGD && kind != OPTIM_RMSPROP) {
+        opt.m = nn_alloc_like(nn);
+    }
+    if (kind == OPTIM_RMSPROP || kind == OPTIM_ADAM) {
+        opt.v = nn_alloc_like(nn);
+    }
+    return opt;
+}
+
+// Update a parameter block with the matching gradient and state blocks
+static void optim_update(Optimizer *opt, Mat p, Mat g, Mat m, Mat v, float lr, float scale) {
+    size_t n = p.rows * p.cols;
+    switch (opt->kind) {
+    case OPTIM_SGD:      sgd_update(p.es, g.es, n, lr, scale); break;
+    case OPTIM_MOMENTUM: momentum_update(p.es, g.es, m.es, n, lr, scale, opt->beta1); break;
+    case OPTIM_NESTEROV: nesterov_update(p.es, g.es, m.es, n, lr, scale, opt->beta1); break;
+    case OPTIM_RMSPROP:  rmsprop_update(p.es, g.es, v.es, n, lr, scale, opt->beta2, opt->eps); break;
+    case OPTIM_ADAM:     adam_update(p.es, g.es, m.es, v.es, n, lr, scale, opt->beta1, opt->beta2, opt->eps); break;
+    default: assert(0 && "unknown optimizer");
+    }
+}
+
+// Apply the gradient accumulated over batch_size samples in g and zero it
+void optim_step(Optimizer *opt, NN nn, NN g, size_t batch_size) {
+    assert(g.param_count == nn.param_count);
+    assert(batch_size > 0);
+
+    float scale = 1.0f / (float)batch_size;
+    float lr = opt->learning_rate;
+
+    opt->t++;
+    if (opt->kind == OPTIM_ADAM) {
+        lr *= sqrtf(1.0f - powf(opt->beta2, (float)opt->t)) / (1.0f - powf(opt->beta1, (float)opt->t));
+    }
+
+    // Parameters, gradient and state share one slab layout, so the update is a single sweep
+    // State slabs are unused (empty) for kinds that don't need them
+    Mat none = {0};
+    optim_update(opt, nn_params(nn), nn_params(g), opt->m.params ? nn_params(opt->m) : none,
+                 opt->v.params ? nn_params(opt->v) : none, lr, scale);
+}
+
+void optim_free(Optimizer opt) {
+    if (opt.m.ws) nn_free(opt.m);
+    if (opt.v.ws) nn_free(opt.v);
+}
+
+const char *optim_name(OptimKind kind) {
+    switch (kind) {
+    case OPTIM_SGD:      return "sgd";
+    case OPTIM_MOMENTUM: return "momentum";
+    case OPTIM_NESTEROV: return "nesterov";
+    case OPTIM_RMSPROP:  return "rmsprop";
+    case OPTIM_ADAM:     return "adam";
+    default:             return "unknown";
+    }
+}
@@ -0,0 +1,166 @@
+#include "prof.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Accumulated ticks and calls per slot since the last report
+// Eval workers, the nn_server batcher and nn_dist backprop all time the same slots, so they are atomic
+static _Atomic uint64_t prof_ticks[PROF_SLOT_COUNT];
+static _Atomic uint64_t prof_calls[PROF_SLOT_COUNT];
+
+// Wall clock and ticks at the last reset, their ratio converts ticks to nanoseconds
+static uint64_t reset_ticks;
+static double reset_ns;
+
+static const char *prof_names[PROF_PHASE_COUNT] = {
+    [PROF_EPOCH]    = "epoch",
+    [PROF_FORWARD]  = "forward",
+    [PROF_COST]     = "cost",
+    [PROF_BACKPROP] = "backprop",
+    [PROF_OPTIM]    = "optimizer",
+};
+
+static double wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void prof_add(int slot, uint64_t ticks) {
+    atomic_fetch_add_explicit(&prof_ticks[slot], ticks, memory_order_relaxed);
+    atomic_fetch_add_explicit(&prof_calls[slot], 1, memory_order_relaxed);
+}
+
+static uint64_t prof_load(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void prof_reset(void) {
+    for (int i = 0; i < PROF_SLOT_COUNT; i++) {
+        atomic_store_explicit(&prof_ticks[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&prof_calls[i], 0, memory_order_relaxed);
+    }
+    reset_ticks = prof_now();
+    reset_ns = wall_ns();
+}
+
+// Time accumulated in a slot since the last reset
+double prof_seconds(int slot) {
+    uint64_t ticks = prof_now() - reset_ticks;
+    double ns_per_tick = (reset_ticks != 0 && ticks > 0) ? (wall_ns() - reset_ns) / ticks : 1.0;
+    return prof_load(&prof_ticks[slot]) * ns_per_tick / 1e9;
+}
+
+static void prof_row(FILE *out, const char *name, int slot, double ns_per_tick, uint64_t epoch_ticks) {
+    uint64_t calls = prof_load(&prof_calls[slot]), slot_ticks = prof_load(&prof_ticks[slot]);
+    if (calls == 0) return;
+    double ms = slot_ticks * ns_per_tick / 1e6;
+    fprintf(out, "  %-14s %10llu calls %10.2f ms %6.2f%% %10.0f ns/call\n", name,
+            (unsigned long long)calls, ms,
+            epoch_ticks ? 100.0 * slot_ticks / epoch_ticks : 0.0,
+            slot_ticks * ns_per_tick / calls);
+}
+
+// Trace output, every event goes through one mutex protected buffered stream
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned trace_rate = 1;
+static atomic_int trace_on;
+
+static long trace_tid(void) {
+    static _Thread_local long tid;
+    if (tid == 0) tid = syscall(SYS_gettid);
+    return tid;
+}
+
+// Start writing trace events to filename, nn_forward and backprop are traced one call in sample_rate
+int prof_trace_open(const char *filename, unsigned sample_rate) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s for tracing.\n", filename);
+        return -1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_file = file;
+    trace_rate = sample_rate > 0 ? sample_rate : 1;
+    fprintf(trace_file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    pthread_mutex_unlock(&trace_lock);
+    atomic_store(&trace_on, 1);
+    return 0;
+}
+
+// Close the JSON document, events sent after this are dropped
+void prof_trace_close(void) {
+    atomic_store(&trace_on, 0);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"c-digit-recognition\"}}\n]}\n",
+                (int)getpid());
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int prof_trace_enabled(void) {
+    return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+// True for one call in sample_rate while tracing, every call site counts on its own
+int prof_trace_sample(atomic_uint *counter) {
+    if (!prof_trace_enabled()) return 0;
+    return atomic_fetch_add_explicit(counter, 1, memory_order_relaxed) % trace_rate == 0;
+}
+
+// Monotonic nanoseconds, never 0 so it doubles as "not traced"
+uint64_t prof_trace_ts(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec + 1;
+}
+
+// A complete event on the calling thread, layer < 0 leaves the layer out
+void prof_trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, int layer) {
+    long tid = trace_tid();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f",
+                name, (int)getpid(), tid, start_ns / 1e3, (end_ns - start_ns) / 1e3);
+        if (layer >= 0) fprintf(trace_file, ", \"args\": {\"layer\": %d}", layer);
+        fprintf(trace_file, "},\n");
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Name the calling thread in the trace viewer
+void prof_trace_thread_name(const char *name) {
+    long tid = trace_tid();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, \"args\": {\"name\": \"%s\"}},\n",
+                (int)getpid(), tid, name);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Print where the time since the last report went and start over
+void prof_epoch_report(FILE *out) {
+    // Calibrate ticks against the wall clock over the whole reporting period
+    uint64_t ticks = prof_now() - reset_ticks;
+    double ns_per_tick = (reset_ticks != 0 && ticks > 0) ? (wall_ns() - reset_ns) / ticks : 1.0;
+    uint64_t epoch_ticks = prof_load(&prof_ticks[PROF_EPOCH]);
+
+    for (int i = 0; i < PROF_PHASE_COUNT; i++) {
+        prof_row(out, prof_names[i], i, ns_per_tick, epoch_ticks);
+
+        if (i == PROF_FORWARD || i == PROF_BACKPROP) {
+            for (int l = 0; l < PROF_MAX_LAYERS; l++) {
+                char name[32];
+                snprintf(name, sizeof(name), "  layer %d", l);
+                prof_row(out, name, i == PROF_FORWARD ? PROF_LAYER_FORWARD(l) : PROF_LAYER_BACKWARD(l), ns_per_tick, epoch_ticks);
+            }
+        }
+    }
+
+    prof_reset();
+}
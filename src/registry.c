@@ -0,0 +1,154 @@
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+static void model_put(Model *model) {
+    if (atomic_fetch_sub_explicit(&model->refs, 1, memory_order_acq_rel) == 1) {
+        nn_free(model->nn);
+        free(model);
+    }
+}
+
+// A new version may change weights and activations but not the layer sizes,
+// batch contexts allocated for the first version are reused for every later one
+static int same_architecture(NN a, NN b) {
+    if (a.size != b.size) return 0;
+    for (size_t i = 0; i < a.size; i++) {
+        if (a.ws[i].rows != b.ws[i].rows || a.ws[i].cols != b.ws[i].cols) return 0;
+    }
+    return 1;
+}
+
+// Load the model file again and swap it in, returns 0 on success
+// Readers that already hold the old version keep using it until they release it
+int registry_reload(Registry *registry) {
+    NN nn;
+    if (nn_try_load(registry->path, &nn) != 0) {
+        atomic_fetch_add(&registry->failures, 1);
+        return -1;
+    }
+    if (registry->current && !same_architecture(nn, registry->current->nn)) {
+        fprintf(stderr, "registry: %s changed architecture, restart to serve it\n", registry->path);
+        nn_free(nn);
+        atomic_fetch_add(&registry->failures, 1);
+        return -1;
+    }
+
+    Model *model = malloc(sizeof(Model));
+    assert(model != NULL);
+    model->nn = nn;
+    atomic_init(&model->refs, 1);
+
+    pthread_mutex_lock(&registry->lock);
+    Model *old = registry->current;
+    model->version = ++registry->version;
+    registry->current = model;
+    pthread_mutex_unlock(&registry->lock);
+
+    if (old) {
+        atomic_fetch_add(&registry->reloads, 1);
+        model_put(old);
+    }
+    return 0;
+}
+
+// Reload whenever the model file is closed after writing or renamed over,
+// both a file rewritten in place and nn_save, which renames a temp file over it, are seen
+static void *watcher_thread(void *arg) {
+    Registry *registry = arg;
+
+    char copy[sizeof(registry->path)];
+    snprintf(copy, sizeof(copy), "%s", registry->path);
+    const char *name = basename(copy);
+
+    _Alignas(struct inotify_event) char buf[4096];
+    struct pollfd fds[2] = { { registry->inotify_fd, POLLIN, 0 }, { registry->stop_fd[0], POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) continue;
+        if (fds[1].revents) break;
+
+        // Drain every pending event first so a burst of writes gives one reload
+        int changed = 0;
+        ssize_t n;
+        while ((n = read(registry->inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                if (event->len && strcmp(event->name, name) == 0) changed = 1;
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (changed && registry_reload(registry) == 0) {
+            fprintf(stderr, "registry: loaded version %u of %s\n", registry->version, registry->path);
+        }
+    }
+    return NULL;
+}
+
+// Load path and start watching it, returns NULL if the first version can't be loaded
+Registry *registry_open(const char *path) {
+    Registry *registry = calloc(1, sizeof(Registry));
+    assert(registry != NULL);
+    snprintf(registry->path, sizeof(registry->path), "%s", path);
+    pthread_mutex_init(&registry->lock, NULL);
+
+    if (registry_reload(registry) != 0) {
+        pthread_mutex_destroy(&registry->lock);
+        free(registry);
+        return NULL;
+    }
+
+    // Watch the directory, the file itself is replaced by renames
+    char copy[sizeof(registry->path)];
+    snprintf(copy, sizeof(copy), "%s", path);
+    registry->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (registry->inotify_fd < 0 || inotify_add_watch(registry->inotify_fd, dirname(copy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pipe(registry->stop_fd) != 0) {
+        perror("registry: inotify");
+        registry_close(registry);
+        return NULL;
+    }
+    pthread_create(&registry->watcher, NULL, watcher_thread, registry);
+    return registry;
+}
+
+// Stop watching and drop the registry reference, readers still holding a model keep it alive
+void registry_close(Registry *registry) {
+    if (registry->stop_fd[1] > 0) {
+        char byte = 0;
+        if (write(registry->stop_fd[1], &byte, 1) == 1) pthread_join(registry->watcher, NULL);
+        close(registry->stop_fd[0]);
+        close(registry->stop_fd[1]);
+    }
+    if (registry->inotify_fd > 0) close(registry->inotify_fd);
+
+    model_put(registry->current);
+    pthread_mutex_destroy(&registry->lock);
+    free(registry);
+}
+
+// Pin the current version, the caller must registry_release it when done
+Model *registry_acquire(Registry *registry) {
+    pthread_mutex_lock(&registry->lock);
+    Model *model = registry->current;
+    atomic_fetch_add_explicit(&model->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&registry->lock);
+    return model;
+}
+
+void registry_release(Model *model) {
+    model_put(model);
+}
+
+// Point a batch context from nn_batch_alloc at the weights of a pinned model
+NN model_bind(Model *model, NN batch) {
+    batch.ws = model->nn.ws;
+    batch.bs = model->nn.bs;
+    batch.acts = model->nn.acts;
+    batch.kernel = model->nn.kernel;
+    return batch;
+}
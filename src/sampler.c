@@ -0,0 +1,75 @@
+#include "sampler.h"
+
+// splitmix64, a tiny generator whose whole state is one word so every epoch can be reseeded
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Uniform integer in [0, n)
+static size_t rng_below(uint64_t *state, size_t n) {
+    return (size_t)(rng_next(state) % n);
+}
+
+// Fisher-Yates shuffle of a[0..n)
+static void shuffle(size_t *a, size_t n, uint64_t *state) {
+    for (size_t i = n; i > 1; i--) {
+        size_t j = rng_below(state, i);
+        size_t tmp = a[i - 1];
+        a[i - 1] = a[j];
+        a[j] = tmp;
+    }
+}
+
+Sampler sampler_alloc(size_t count, size_t block_size, size_t window, uint64_t seed) {
+    Sampler sampler;
+    sampler.count = count;
+    sampler.block_size = block_size;
+    sampler.window = window > 0 ? window : 1;
+    sampler.seed = seed;
+    sampler.order = malloc((count > 0 ? count : 1) * sizeof(*sampler.order));
+    assert(sampler.order != NULL);
+
+    for (size_t i = 0; i < count; i++) sampler.order[i] = i;
+    return sampler;
+}
+
+// Fill sampler.order for an epoch, the same seed and epoch always give the same order
+void sampler_shuffle(Sampler sampler, size_t epoch) {
+    uint64_t state = sampler.seed ^ (epoch * 0xD1B54A32D192ED03ull);
+
+    if (sampler.block_size <= 1) {
+        for (size_t i = 0; i < sampler.count; i++) sampler.order[i] = i;
+        shuffle(sampler.order, sampler.count, &state);
+        return;
+    }
+
+    // Shuffle the order of the blocks
+    size_t blocks = (sampler.count + sampler.block_size - 1) / sampler.block_size;
+    size_t *block_order = malloc(blocks * sizeof(*block_order));
+    assert(block_order != NULL);
+    for (size_t b = 0; b < blocks; b++) block_order[b] = b;
+    shuffle(block_order, blocks, &state);
+
+    // Lay the blocks out in that order, each block stays a sequential run
+    size_t k = 0;
+    for (size_t b = 0; b < blocks; b++) {
+        size_t start = block_order[b] * sampler.block_size;
+        size_t end = start + sampler.block_size < sampler.count ? start + sampler.block_size : sampler.count;
+        for (size_t i = start; i < end; i++) sampler.order[k++] = i;
+    }
+    free(block_order);
+
+    // Shuffle inside each window of consecutive blocks
+    size_t span = sampler.block_size * sampler.window;
+    for (size_t start = 0; start < sampler.count; start += span) {
+        size_t n = sampler.count - start < span ? sampler.count - start : span;
+        shuffle(sampler.order + start, n, &state);
+    }
+}
+
+void sampler_free(Sampler sampler) {
+    free(sampler.order);
+}
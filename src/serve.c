@@ -0,0 +1,79 @@
+#include "serve.h"
+#include <unistd.h>
+#include <errno.h>
+
+// Read exactly size bytes, returns 0 on success and -1 on error or end of stream
+int serve_read_full(int fd, void *buf, size_t size) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Write exactly size bytes, returns 0 on success and -1 on error
+int serve_write_full(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+void histogram_add(Histogram *h, uint64_t ns) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (ns >> (bucket + 1)) != 0) bucket++;
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max) h->max = ns;
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Upper bound of the bucket holding the p-th percentile, p in [0, 1]
+uint64_t histogram_percentile(const Histogram *h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (h->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = (2ull << i) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Summary line and one bar per non empty bucket
+void histogram_print(const Histogram *h, FILE *out, const char *title) {
+    fprintf(out, "%s: %llu requests, mean %.1f us, p50 <= %.1f us, p99 <= %.1f us, p999 <= %.1f us, max %.1f us\n",
+            title, (unsigned long long)h->count, h->count ? h->sum / h->count / 1e3 : 0.0,
+            histogram_percentile(h, 0.50) / 1e3, histogram_percentile(h, 0.99) / 1e3,
+            histogram_percentile(h, 0.999) / 1e3, h->max / 1e3);
+
+    uint64_t most = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] > most) most = h->buckets[i];
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+        int width = (int)(40 * h->buckets[i] / most);
+        fprintf(out, "  %10.1f - %10.1f us %8llu |%.*s\n", (1ull << i) / 1e3, (2ull << i) / 1e3,
+                (unsigned long long)h->buckets[i], width > 0 ? width : 1, "########################################");
+    }
+}
@@ -0,0 +1,242 @@
+#include "shm_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHM_RING_PAUSE() _mm_pause()
+#else
+#define SHM_RING_PAUSE() ((void)0)
+#endif
+
+#define SHM_RING_ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+// The segment is shared between processes so no FUTEX_PRIVATE_FLAG
+static void futex_wait(atomic_uint *addr, unsigned int expected, const struct timespec *timeout) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static size_t slot_bytes(uint32_t input_size, uint32_t num_classes) {
+    return SHM_RING_ALIGN(sizeof(ShmSlot)) + SHM_RING_ALIGN(input_size * sizeof(float)) + SHM_RING_ALIGN(num_classes * sizeof(float));
+}
+
+static void shm_ring_set_sizes(ShmRing *ring, uint32_t slots, uint32_t input_size, uint32_t num_classes) {
+    ring->slots = slots;
+    ring->input_size = input_size;
+    ring->num_classes = num_classes;
+    ring->slot_bytes = slot_bytes(input_size, num_classes);
+    ring->scores_offset = SHM_RING_ALIGN(sizeof(ShmSlot)) + SHM_RING_ALIGN(input_size * sizeof(float));
+}
+
+static ShmRing *shm_ring_map(const char *name, int fd, size_t size, int owner) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("shm_ring: mmap");
+        return NULL;
+    }
+
+    ShmRing *ring = calloc(1, sizeof(ShmRing));
+    assert(ring != NULL);
+    ring->header = base;
+    ring->size = size;
+    ring->owner = owner;
+    // On a single cpu the other side can't make progress while we spin
+    ring->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_RING_SPIN : 0;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    return ring;
+}
+
+// Create and map a new ring, name is a POSIX shm name like "/nn_ring"
+// slots must be a power of two, the free running head and tail wrap at 2^32 onto the same slot as the producer
+ShmRing *shm_ring_create(const char *name, uint32_t slots, uint32_t input_size, uint32_t num_classes) {
+    assert(slots > 0 && (slots & (slots - 1)) == 0);
+    size_t size = SHM_RING_ALIGN(sizeof(ShmRingHeader)) + slots * slot_bytes(input_size, num_classes);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        perror("shm_ring: shm_open");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    ShmRing *ring = shm_ring_map(name, fd, size, 1);
+    if (!ring) return NULL;
+
+    // ftruncate zeroed the segment, so every slot starts free
+    shm_ring_set_sizes(ring, slots, input_size, num_classes);
+    ShmRingHeader *h = ring->header;
+    h->slots = slots;
+    h->input_size = input_size;
+    h->num_classes = num_classes;
+    h->slot_bytes = (uint32_t)slot_bytes(input_size, num_classes);
+    atomic_thread_fence(memory_order_release);
+    h->magic = SHM_RING_MAGIC;
+    return ring;
+}
+
+// Map a ring created by another process, the layout is checked against the stored sizes
+ShmRing *shm_ring_open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_ring: shm_open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    ShmRing *ring = shm_ring_map(name, fd, st.st_size, 0);
+    if (!ring) return NULL;
+
+    // Read every field once, what gets checked is what gets used
+    volatile ShmRingHeader *h = ring->header;
+    uint32_t magic = h->magic, slots = h->slots, input_size = h->input_size;
+    uint32_t num_classes = h->num_classes, stored_bytes = h->slot_bytes;
+    if (magic != SHM_RING_MAGIC || slots == 0 || (slots & (slots - 1)) != 0 ||
+        stored_bytes != slot_bytes(input_size, num_classes) ||
+        SHM_RING_ALIGN(sizeof(ShmRingHeader)) + (size_t)slots * stored_bytes > ring->size) {
+        fprintf(stderr, "shm_ring: %s is not a valid ring\n", name);
+        shm_ring_close(ring);
+        return NULL;
+    }
+    shm_ring_set_sizes(ring, slots, input_size, num_classes);
+    return ring;
+}
+
+void shm_ring_close(ShmRing *ring) {
+    if (!ring) return;
+    munmap(ring->header, ring->size);
+    if (ring->owner) shm_unlink(ring->name);
+    free(ring);
+}
+
+ShmSlot *shm_ring_slot(ShmRing *ring, uint32_t slot) {
+    return (ShmSlot *)((char *)ring->header + SHM_RING_ALIGN(sizeof(ShmRingHeader)) + (size_t)(slot & (ring->slots - 1)) * ring->slot_bytes);
+}
+
+float *shm_ring_input(ShmRing *ring, uint32_t slot) {
+    return (float *)((char *)shm_ring_slot(ring, slot) + SHM_RING_ALIGN(sizeof(ShmSlot)));
+}
+
+float *shm_ring_scores(ShmRing *ring, uint32_t slot) {
+    return (float *)((char *)shm_ring_slot(ring, slot) + ring->scores_offset);
+}
+
+// Next slot in ring order, the producer keeps at most slots requests in flight
+// The input can be written into shm_ring_input(ring, slot) before shm_ring_publish
+uint32_t shm_ring_acquire(ShmRing *ring) {
+    uint32_t slot = ring->next;
+    ring->next = (ring->next + 1) & (ring->slots - 1);
+
+    ShmSlot *s = shm_ring_slot(ring, slot);
+    assert(atomic_load_explicit(&s->state, memory_order_acquire) == SHM_SLOT_FREE);
+    return slot;
+}
+
+// Hand a filled slot to the workers, slots must be published in the order they were acquired
+void shm_ring_publish(ShmRing *ring, uint32_t slot, uint32_t id) {
+    ShmRingHeader *h = ring->header;
+    ShmSlot *s = shm_ring_slot(ring, slot);
+    s->id = id;
+    s->label = -1;
+    atomic_store_explicit(&s->state, SHM_SLOT_REQUEST, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->head, 1, memory_order_seq_cst);
+
+    // seq_cst on head and sleepers pairs with shm_ring_claim so a worker can't sleep through this request
+    if (atomic_load_explicit(&h->sleepers, memory_order_seq_cst) > 0) futex_wake(&h->head, 1);
+}
+
+// Wait until a worker completed the slot, returns the predicted label or -1 if the ring was stopped
+int shm_ring_wait(ShmRing *ring, uint32_t slot) {
+    ShmSlot *s = shm_ring_slot(ring, slot);
+    for (int i = 0; i < ring->spin; i++) {
+        if (atomic_load_explicit(&s->state, memory_order_acquire) == SHM_SLOT_DONE) return s->label;
+        SHM_RING_PAUSE();
+    }
+
+    // Sleep with a timeout so a stopped ring is noticed even if the server went away
+    const struct timespec timeout = { 0, 100 * 1000 * 1000 };
+    atomic_store_explicit(&s->sleeping, 1, memory_order_seq_cst);
+    while (atomic_load_explicit(&s->state, memory_order_seq_cst) != SHM_SLOT_DONE) {
+        if (atomic_load_explicit(&ring->header->stop, memory_order_acquire)) {
+            atomic_store_explicit(&s->sleeping, 0, memory_order_relaxed);
+            return -1;
+        }
+        futex_wait(&s->state, SHM_SLOT_REQUEST, &timeout);
+    }
+    atomic_store_explicit(&s->sleeping, 0, memory_order_relaxed);
+    return s->label;
+}
+
+// Give a completed slot back to the producer once its scores have been read
+void shm_ring_release(ShmRing *ring, uint32_t slot) {
+    atomic_store_explicit(&shm_ring_slot(ring, slot)->state, SHM_SLOT_FREE, memory_order_release);
+}
+
+// Wake up every worker, shm_ring_claim returns -1 from now on
+void shm_ring_stop(ShmRing *ring) {
+    ShmRingHeader *h = ring->header;
+    atomic_store_explicit(&h->stop, 1, memory_order_seq_cst);
+    futex_wake(&h->head, INT32_MAX);
+}
+
+// Claim the oldest published slot, sleeps while the ring is empty
+int shm_ring_claim(ShmRing *ring) {
+    ShmRingHeader *h = ring->header;
+    for (;;) {
+        if (atomic_load_explicit(&h->stop, memory_order_acquire)) return -1;
+
+        unsigned int tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&h->head, memory_order_acquire);
+        if (tail != head) {
+            if (atomic_compare_exchange_weak_explicit(&h->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_relaxed)) {
+                return (int)(tail & (ring->slots - 1));
+            }
+            continue;
+        }
+
+        // Empty, spin a bit then sleep on head
+        int spins = 0;
+        while (atomic_load_explicit(&h->head, memory_order_acquire) == head && spins < ring->spin) {
+            SHM_RING_PAUSE();
+            spins++;
+        }
+        if (spins < ring->spin) continue;
+
+        // stop doesn't change head, a stop landing between the check and futex_wait is only
+        // noticed once the timeout runs out
+        const struct timespec timeout = { 0, 100 * 1000 * 1000 };
+        atomic_fetch_add_explicit(&h->sleepers, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&h->head, memory_order_seq_cst) == head && !atomic_load_explicit(&h->stop, memory_order_seq_cst)) {
+            futex_wait(&h->head, head, &timeout);
+        }
+        atomic_fetch_sub_explicit(&h->sleepers, 1, memory_order_seq_cst);
+    }
+}
+
+// Publish the result of a claimed slot, the scores must already be in shm_ring_scores
+void shm_ring_complete(ShmRing *ring, uint32_t slot, int label) {
+    ShmSlot *s = shm_ring_slot(ring, slot);
+    s->label = label;
+    atomic_store_explicit(&s->state, SHM_SLOT_DONE, memory_order_seq_cst);
+
+    // Skip the syscall while the producer is still spinning
+    if (atomic_load_explicit(&s->sleeping, memory_order_seq_cst)) futex_wake(&s->state, 1);
+}
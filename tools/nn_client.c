@@ -0,0 +1,333 @@
+#include "image.h"
+#include "serve.h"
+#include "shm_ring.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Load generator and example client for nn_server
+// Usage: nn_client [--socket PATH] (--image FILE | --dataset DIR) [--tensor] [--shm] [--concurrency N] [--requests N]
+// --image sends one image and prints the scores, --dataset replays the images of a labeled directory
+// from N connections at once and reports accuracy and the client side latency histogram
+// --tensor decodes the images here and sends floats instead of the encoded file
+// --shm sends the decoded tensors through a shared memory ring with N requests in flight instead
+
+
+typedef struct{
+    unsigned char *data;
+    uint32_t size;
+    int label;
+}Payload;
+
+typedef struct{
+    const char *socket_path;
+    Payload *payloads;
+    size_t count;
+    uint32_t kind;
+    size_t first;     // this thread sends requests first, first + stride, ... below total
+    size_t stride;
+    size_t total;
+
+    Histogram latency;
+    size_t answered;
+    size_t correct;
+    size_t failed;
+}Worker;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_server(const char *socket_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("nn_client: connect");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static unsigned char *read_file(const char *path, uint32_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = malloc(length > 0 ? length : 1);
+    if (length < 0 || fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = (uint32_t)length;
+    return data;
+}
+
+// Build the payload once up front so the timed loop only measures the server
+static int make_payload(const char *path, int tensor, Payload *p) {
+    p->data = read_file(path, &p->size);
+    if (!p->data) {
+        fprintf(stderr, "Error: Could not read %s.\n", path);
+        return -1;
+    }
+    if (tensor) {
+        int width, height;
+        float *decoded = load_image_from_memory(p->data, p->size, &width, &height);
+        free(p->data);
+        if (!decoded) return -1;
+        p->data = (unsigned char *)decoded;
+        p->size = (uint32_t)(width * height * 3 * sizeof(float));
+    }
+    return 0;
+}
+
+// Send one request and read its response, scores may be NULL
+static int send_request(int fd, uint32_t kind, const Payload *p, uint32_t id, ServeResponse *res, float **scores) {
+    ServeRequest req = { SERVE_MAGIC, kind, p->size, id };
+    if (serve_write_full(fd, &req, sizeof(req)) != 0 || serve_write_full(fd, p->data, p->size) != 0) return -1;
+    if (serve_read_full(fd, res, sizeof(*res)) != 0) return -1;
+    if (res->status != SERVE_OK) return 0;
+
+    float *buf = malloc(res->num_classes * sizeof(float));
+    if (serve_read_full(fd, buf, res->num_classes * sizeof(float)) != 0) {
+        free(buf);
+        return -1;
+    }
+    if (scores) *scores = buf;
+    else free(buf);
+    return 0;
+}
+
+static void print_summary(size_t requests, size_t concurrency, double seconds, size_t answered, size_t correct, size_t failed, const Histogram *latency) {
+    printf("%zu requests over %zu connections in %.3f s (%.0f req/s), %zu failed\n",
+           requests, concurrency, seconds, answered / seconds, failed);
+    printf("Accuracy: %.2f%% (%zu / %zu)\n", answered ? 100.0 * correct / answered : 0.0, correct, answered);
+    histogram_print(latency, stdout, "Client latency");
+}
+
+// Replay the payloads through a shared memory ring, window requests are kept in flight
+// The ring gets the next power of two slots, shm_ring_create needs one
+static int run_shm(const char *socket_path, const Payload *payloads, size_t count, size_t requests, uint32_t window) {
+    uint32_t slots = 1;
+    while (slots < window) slots <<= 1;
+
+    int fd = connect_server(socket_path);
+    if (fd < 0) return 1;
+
+    // One request over the socket tells how many scores a slot needs room for
+    ServeResponse res;
+    if (send_request(fd, SERVE_TENSOR, &payloads[0], 0, &res, NULL) != 0 || res.status != SERVE_OK) {
+        fprintf(stderr, "nn_client: probe request failed\n");
+        close(fd);
+        return 1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/nn_ring_%d", (int)getpid());
+    ShmRing *ring = shm_ring_create(name, slots, payloads[0].size / sizeof(float), res.num_classes);
+    if (!ring) {
+        close(fd);
+        return 1;
+    }
+    Payload attach = { (unsigned char *)name, (uint32_t)strlen(name), -1 };
+    if (send_request(fd, SERVE_SHM, &attach, 0, &res, NULL) != 0 || res.status != SERVE_OK) {
+        fprintf(stderr, "nn_client: server refused the ring\n");
+        shm_ring_close(ring);
+        close(fd);
+        return 1;
+    }
+
+    uint64_t *started = malloc(slots * sizeof(uint64_t));
+    int *expected = malloc(slots * sizeof(int));
+    Histogram latency = {0};
+    size_t submitted = 0, completed = 0, answered = 0, correct = 0, failed = 0;
+
+    uint64_t start = now_ns();
+    while (completed < requests) {
+        if (submitted < requests && submitted - completed < window) {
+            // The input is written once, straight into the slot the server runs nn_forward on
+            uint32_t slot = shm_ring_acquire(ring);
+            const Payload *p = &payloads[submitted % count];
+            memcpy(shm_ring_input(ring, slot), p->data, p->size);
+            expected[slot] = p->label;
+            started[slot] = now_ns();
+            shm_ring_publish(ring, slot, (uint32_t)submitted);
+            submitted++;
+            continue;
+        }
+
+        // Slots are handed out in ring order, so the oldest request is in slot completed % slots
+        uint32_t slot = completed & (slots - 1);
+        int label = shm_ring_wait(ring, slot);
+        if (label < 0) {
+            failed = requests - completed;
+            break;
+        }
+        histogram_add(&latency, now_ns() - started[slot]);
+        answered++;
+        if (label == expected[slot]) correct++;
+        shm_ring_release(ring, slot);
+        completed++;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    print_summary(requests, 1, seconds, answered, correct, failed, &latency);
+
+    shm_ring_stop(ring);
+    close(fd);
+    shm_ring_close(ring);
+    free(started);
+    free(expected);
+    return failed ? 1 : 0;
+}
+
+static void *worker_thread(void *arg) {
+    Worker *w = arg;
+    int fd = connect_server(w->socket_path);
+    if (fd < 0) {
+        w->failed = (w->total - w->first + w->stride - 1) / w->stride;
+        return NULL;
+    }
+
+    for (size_t i = w->first; i < w->total; i += w->stride) {
+        const Payload *p = &w->payloads[i % w->count];
+        ServeResponse res;
+        uint64_t start = now_ns();
+        if (send_request(fd, w->kind, p, (uint32_t)i, &res, NULL) != 0) {
+            w->failed += (w->total - i + w->stride - 1) / w->stride;
+            break;
+        }
+        histogram_add(&w->latency, now_ns() - start);
+        if (res.status != SERVE_OK || res.id != (uint32_t)i) {
+            w->failed++;
+            continue;
+        }
+        w->answered++;
+        if (res.label == p->label) w->correct++;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Replay the payloads from concurrency connections, each with one request in flight
+static int run_connections(const char *socket_path, Payload *payloads, size_t count, uint32_t kind, size_t requests, size_t concurrency) {
+    Worker *workers = calloc(concurrency, sizeof(Worker));
+    pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (size_t t = 0; t < concurrency; t++) {
+        workers[t] = (Worker){ .socket_path = socket_path, .payloads = payloads, .count = count, .kind = kind,
+                               .first = t, .stride = concurrency, .total = requests };
+        pthread_create(&threads[t], NULL, worker_thread, &workers[t]);
+    }
+
+    Histogram latency = {0};
+    size_t answered = 0, correct = 0, failed = 0;
+    for (size_t t = 0; t < concurrency; t++) {
+        pthread_join(threads[t], NULL);
+        histogram_merge(&latency, &workers[t].latency);
+        answered += workers[t].answered;
+        correct += workers[t].correct;
+        failed += workers[t].failed;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    print_summary(requests, concurrency, seconds, answered, correct, failed, &latency);
+
+    free(workers);
+    free(threads);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = SERVE_DEFAULT_SOCKET;
+    const char *image = NULL;
+    const char *dataset = NULL;
+    int tensor = 0;
+    int shm = 0;
+    size_t concurrency = 8;
+    size_t requests = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) image = argv[++i];
+        else if (strcmp(argv[i], "--dataset") == 0 && i + 1 < argc) dataset = argv[++i];
+        else if (strcmp(argv[i], "--tensor") == 0) tensor = 1;
+        else if (strcmp(argv[i], "--shm") == 0) shm = tensor = 1;
+        else if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc) concurrency = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) requests = strtoul(argv[++i], NULL, 10);
+        else {
+            image = dataset = NULL;
+            break;
+        }
+    }
+    if ((image == NULL) == (dataset == NULL) || (shm && image)) {
+        fprintf(stderr, "Usage: %s [--socket PATH] (--image FILE | --dataset DIR) [--tensor] [--shm] [--concurrency N] [--requests N]\n", argv[0]);
+        return 1;
+    }
+    uint32_t kind = tensor ? SERVE_TENSOR : SERVE_IMAGE;
+
+    // Single image, print the prediction
+    if (image) {
+        Payload p = { .label = -1 };
+        if (make_payload(image, tensor, &p) != 0) return 1;
+        int fd = connect_server(socket_path);
+        if (fd < 0) return 1;
+
+        ServeResponse res;
+        float *scores = NULL;
+        if (send_request(fd, kind, &p, 0, &res, &scores) != 0) {
+            fprintf(stderr, "nn_client: connection lost\n");
+            return 1;
+        }
+        if (res.status != SERVE_OK) {
+            fprintf(stderr, "nn_client: request rejected with status %u\n", res.status);
+            return 1;
+        }
+        printf("Predicted class: %d\n", res.label);
+        for (uint32_t i = 0; i < res.num_classes; i++) printf("  %u: %f\n", i, scores[i]);
+
+        close(fd);
+        free(scores);
+        free(p.data);
+        return 0;
+    }
+
+    // Replay a labeled directory
+    char **paths;
+    int *labels;
+    int num_classes;
+    int count = list_directory_with_labels(dataset, &paths, &labels, &num_classes);
+    if (count <= 0) {
+        fprintf(stderr, "Error: No images in %s.\n", dataset);
+        return 1;
+    }
+    Payload *payloads = calloc(count, sizeof(Payload));
+    for (int i = 0; i < count; i++) {
+        if (make_payload(paths[i], tensor, &payloads[i]) != 0) return 1;
+        payloads[i].label = labels[i];
+    }
+    if (requests == 0) requests = count;
+    if (concurrency == 0) concurrency = 1;
+
+    int status = shm ? run_shm(socket_path, payloads, count, requests, (uint32_t)concurrency)
+                     : run_connections(socket_path, payloads, count, kind, requests, concurrency);
+
+    for (int i = 0; i < count; i++) {
+        free(payloads[i].data);
+        free(paths[i]);
+    }
+    free(payloads);
+    free(paths);
+    free(labels);
+    return status;
+}
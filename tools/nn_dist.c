@@ -0,0 +1,360 @@
+#include "nn.h"
+#include "optim.h"
+#include "eval.h"
+#include "sampler.h"
+#include "allreduce.h"
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Data parallel training over several processes
+// Every worker loads its own shard of the dataset, trains a full replica of the network and sums the
+// gradients of each batch with every other worker over a ring all-reduce (allreduce.h) before the
+// optimizer step, so all replicas take the same steps on a batch of batch * workers samples
+// The gradients of a layer are sent as soon as backprop is done with it, while the layers before it
+// are still being computed
+// --compress q8 or topk shrinks what goes on the wire, with error feedback, see RingCompression
+// Usage: nn_dist (--dataset DIR | --synthetic N) [--workers N] [--unix PATH | --tcp HOST:PORT | --peers A,B,..]
+//                [--rank R] [--arch 2352,128,10] [--act NAME] [--optim NAME] [--lr RATE] [--batch N]
+//                [--epochs N] [--seed N] [--out FILE] [--no-overlap] [--compress exact|q8|topk] [--topk RATIO]
+// Without --rank it is the launcher, it starts the N workers on this machine and waits for them
+// Worker R listens on PATH.R or HOST:PORT+R, --peers lists the "unix:PATH" / "tcp:HOST:PORT" of every
+// worker instead, so a worker started by hand with --rank can live on another machine
+
+
+#define MAX_LAYERS 16
+#define MAX_WORKERS 64
+
+typedef struct{
+    const char *dataset;
+    int synthetic;
+    int world;
+    int rank;
+    const char *peers[MAX_WORKERS];
+    size_t arch[MAX_LAYERS];
+    size_t arch_count;
+    Activation hidden_act;
+    OptimKind optimizer_kind;
+    float learning_rate;
+    size_t batch_size;
+    int epochs;
+    unsigned long seed;
+    const char *out;
+    int overlap;
+    RingCompression compression;
+    float topk_ratio;
+}Config;
+
+// Backprop hook, the gradients of a layer are final for this batch and go on the wire
+typedef struct{
+    Ring *ring;
+    NN g;
+    NN residual;    // what compression held back from earlier batches, same layout as g
+}Exchange;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t parse_arch(const char *text, size_t *arch) {
+    size_t count = 0;
+    char *end;
+    while (*text && count < MAX_LAYERS) {
+        arch[count++] = strtoul(text, &end, 10);
+        if (*end != ',') break;
+        text = end + 1;
+    }
+    return count;
+}
+
+static int parse_name(const char *text, const char *(*name)(int), int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(text, name(i)) == 0) return i;
+    }
+    fprintf(stderr, "Unknown name %s\n", text);
+    exit(1);
+}
+
+static const char *act_name(int act) { return nn_activation_name(act); }
+static const char *opt_name(int kind) { return optim_name(kind); }
+static const char *compression_name(int kind) { return ring_compression_name(kind); }
+
+static void post_layer(void *ctx, size_t layer) {
+    Exchange *x = ctx;
+    Mat params = nn_layer_params(x->g, layer);
+    ring_post(x->ring, params.es, nn_layer_params(x->residual, layer).es, params.cols);
+}
+
+// FNV-1a over the parameter bytes, equal on every replica that is still in sync
+static uint64_t params_hash(NN nn) {
+    const unsigned char *bytes = (const unsigned char *)nn.params;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < nn.param_count * sizeof(float); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Sum integers over every rank exactly, a float all-reduce stops counting one by one at 2^24
+// Each value travels as four 16 bit pieces, MAX_WORKERS of them still add up exactly in a float
+static int allreduce_counts(Ring *ring, uint64_t *values, size_t count) {
+    float *pieces = malloc(4 * count * sizeof(float));
+    assert(pieces != NULL);
+    for (size_t i = 0; i < count; i++) {
+        for (int p = 0; p < 4; p++) pieces[4 * i + p] = (values[i] >> (16 * p)) & 0xffff;
+    }
+    int status = ring_allreduce(ring, pieces, 4 * count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = 0;
+        for (int p = 0; p < 4; p++) values[i] += (uint64_t)pieces[4 * i + p] << (16 * p);
+    }
+    free(pieces);
+    return status;
+}
+
+static int run_worker(Config *cfg) {
+    int rank = cfg->rank, world = cfg->world;
+    int input_size = cfg->arch[0];
+    int num_classes = cfg->arch[cfg->arch_count - 1];
+
+    // Every worker draws the same synthetic dataset and keeps its share, a directory is read shard only
+    srand(cfg->seed);
+    Dataset *dataset;
+    if (cfg->dataset) {
+        dataset = process_directory_shard(cfg->dataset, rank, world);
+    } else {
+        dataset = dataset_synthetic(cfg->synthetic, input_size, num_classes);
+        dataset_shard(dataset, rank, world);
+    }
+    for (int i = 0; i < dataset->count; i++) {
+        if (dataset->image_sizes[i] != input_size || dataset->labels[i] >= num_classes) {
+            fprintf(stderr, "Worker %d: sample %d does not fit a %d -> %d network.\n", rank, i, input_size, num_classes);
+            return 1;
+        }
+    }
+
+    Ring *ring = ring_open(cfg->peers, world, rank);
+    if (!ring) return 1;
+    ring_compress(ring, cfg->compression, cfg->topk_ratio);
+
+    // Shards differ by a sample at most, every worker takes as many steps as the smallest one
+    uint64_t counts[MAX_WORKERS] = {0};
+    counts[rank] = dataset->count;
+    int status = allreduce_counts(ring, counts, world);
+    int steps = dataset->count;
+    for (int r = 0; r < world; r++) steps = counts[r] < (uint64_t)steps ? (int)counts[r] : steps;
+
+    // Rank 0 initializes, the others start from its weights
+    NN nn = nn_alloc(cfg->arch, cfg->arch_count);
+    for (size_t l = 0; l + 1 < nn.size; l++) nn_set_activation(nn, l, cfg->hidden_act);
+    nn_rand(nn, -0.05f, 0.05f);
+    if (status == 0) status = ring_broadcast(ring, nn.params, nn.param_count);
+    nn_specialize(&nn);
+    NN gradient = nn_alloc_like(nn);
+    Optimizer optimizer = optim_alloc(nn, cfg->optimizer_kind, cfg->learning_rate);
+    Sampler sampler = sampler_alloc(dataset->count, 32, 8, cfg->seed + rank);
+    Exchange exchange = { ring, gradient, nn_alloc_like(nn) };
+
+    if (rank == 0) {
+        printf("Workers: %d, %d samples each, batch %zu x %d, %s hidden, %s lr %g, %s, %s gradients",
+               world, steps, cfg->batch_size, world, nn_activation_name(cfg->hidden_act),
+               optim_name(cfg->optimizer_kind), cfg->learning_rate, cfg->overlap ? "overlapped" : "not overlapped",
+               ring_compression_name(cfg->compression));
+        if (cfg->compression == RING_TOPK) printf(" (%g kept)", cfg->topk_ratio);
+        printf("\n");
+    }
+
+    for (int epoch = 0; epoch < cfg->epochs && status == 0; epoch++) {
+        double start = now(), exposed = 0.0, busy = ring->busy_seconds;
+        uint64_t sent = ring->bytes_sent;
+        float total_cost = 0.0f;
+        size_t in_batch = 0;
+
+        sampler_shuffle(sampler, epoch);
+        for (int k = 0; k < steps && status == 0; k++) {
+            size_t i = sampler.order[k];
+            Mat input = mat_view(dataset->images[i], 1, input_size, input_size);
+
+            // The last sample of a batch completes the gradients, layer by layer
+            int last = ++in_batch == cfg->batch_size || k + 1 == steps;
+            if (last && cfg->overlap) total_cost += nn_train_sample_hook(nn, gradient, input, dataset->labels[i], post_layer, &exchange);
+            else total_cost += nn_train_sample(nn, gradient, input, dataset->labels[i]);
+            if (!last) continue;
+
+            double wait = now();
+            if (cfg->overlap) {
+                status = ring_wait(ring);
+            } else {
+                for (size_t l = nn.size; l-- > 0 && status == 0;) {
+                    Mat params = nn_layer_params(gradient, l);
+                    status = ring_reduce(ring, params.es, nn_layer_params(exchange.residual, l).es, params.cols);
+                }
+            }
+            exposed += now() - wait;
+
+            optim_step(&optimizer, nn, gradient, in_batch * world);
+            in_batch = 0;
+        }
+
+        uint64_t samples = steps;
+        if (status == 0) status = ring_allreduce(ring, &total_cost, 1);
+        if (status == 0) status = allreduce_counts(ring, &samples, 1);
+        double elapsed = now() - start;
+        if (rank == 0 && status == 0) {
+            printf("Epoch %d/%d, Cost: %.4f, %.1f samples/s, comm %.3fs busy %.3fs exposed, %.1f MiB sent\n",
+                   epoch + 1, cfg->epochs, total_cost / samples, samples / elapsed,
+                   ring->busy_seconds - busy, exposed, (ring->bytes_sent - sent) / 1048576.0);
+        }
+    }
+
+    // Accuracy over every shard, then check that no replica drifted
+    if (status == 0) {
+        Evaluation eval = nn_evaluate(nn, dataset, 64, 1);
+        uint64_t totals[2] = { eval.correct, eval.count };
+        eval_free(eval);
+        status = allreduce_counts(ring, totals, 2);
+
+        // Every rank contributes its hash in its own slot, the sum gathers them all
+        uint64_t hashes[MAX_WORKERS] = {0};
+        hashes[rank] = params_hash(nn);
+        if (status == 0) status = allreduce_counts(ring, hashes, world);
+        int in_sync = 1;
+        for (int r = 1; r < world; r++) in_sync &= hashes[r] == hashes[0];
+
+        if (rank == 0 && status == 0) {
+            printf("Accuracy: %.2f%% over %llu samples, replicas %s\n",
+                   100.0 * totals[0] / totals[1], (unsigned long long)totals[1], in_sync ? "in sync" : "DIVERGED");
+            if (!in_sync) status = -1;
+            else if (cfg->out && nn_save(nn, cfg->out) == 0) printf("Model saved to %s\n", cfg->out);
+            else if (cfg->out) status = -1;
+        }
+    }
+    if (status != 0) fprintf(stderr, "Worker %d: training failed.\n", rank);
+
+    ring_close(ring);
+    sampler_free(sampler);
+    optim_free(optimizer);
+    nn_free(exchange.residual);
+    nn_free(gradient);
+    nn_free(nn);
+    dataset_free(dataset);
+    return status == 0 ? 0 : 1;
+}
+
+// Start one process per worker and wait, the first one to fail takes the others down with it
+static int launch(Config *cfg) {
+    pid_t pids[MAX_WORKERS];
+    fflush(stdout);
+    for (int r = 0; r < cfg->world; r++) {
+        pids[r] = fork();
+        if (pids[r] < 0) {
+            perror("nn_dist: fork");
+            for (int i = 0; i < r; i++) kill(pids[i], SIGTERM);
+            return 1;
+        }
+        if (pids[r] == 0) {
+            cfg->rank = r;
+            exit(run_worker(cfg));
+        }
+    }
+
+    int failed = 0;
+    for (int left = cfg->world; left > 0; left--) {
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) break;
+        if (!failed && !(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)) {
+            failed = 1;
+            for (int r = 0; r < cfg->world; r++) {
+                if (pids[r] != pid) kill(pids[r], SIGTERM);
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    Config cfg = {
+        .world = 2, .rank = -1, .arch = {2352, 128, 10}, .arch_count = 3, .hidden_act = ACT_SIGMOID,
+        .optimizer_kind = OPTIM_SGD, .learning_rate = 0.1f, .batch_size = 32, .epochs = 3, .seed = 1, .overlap = 1,
+        .compression = RING_EXACT, .topk_ratio = 0.01f,
+    };
+    const char *unix_base = NULL, *tcp = NULL;
+    char *peer_list = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-overlap") == 0) {
+            cfg.overlap = 0;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--dataset") == 0) cfg.dataset = argv[++i];
+        else if (strcmp(argv[i], "--synthetic") == 0) cfg.synthetic = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0) cfg.world = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--unix") == 0) unix_base = argv[++i];
+        else if (strcmp(argv[i], "--tcp") == 0) tcp = argv[++i];
+        else if (strcmp(argv[i], "--peers") == 0) peer_list = argv[++i];
+        else if (strcmp(argv[i], "--rank") == 0) cfg.rank = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--arch") == 0) cfg.arch_count = parse_arch(argv[++i], cfg.arch);
+        else if (strcmp(argv[i], "--act") == 0) cfg.hidden_act = parse_name(argv[++i], act_name, ACT_SOFTMAX);
+        else if (strcmp(argv[i], "--optim") == 0) cfg.optimizer_kind = parse_name(argv[++i], opt_name, OPTIM_ADAM + 1);
+        else if (strcmp(argv[i], "--lr") == 0) cfg.learning_rate = strtof(argv[++i], NULL);
+        else if (strcmp(argv[i], "--batch") == 0) cfg.batch_size = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--epochs") == 0) cfg.epochs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0) cfg.seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--out") == 0) cfg.out = argv[++i];
+        else if (strcmp(argv[i], "--compress") == 0) cfg.compression = parse_name(argv[++i], compression_name, RING_TOPK + 1);
+        else if (strcmp(argv[i], "--topk") == 0) cfg.topk_ratio = strtof(argv[++i], NULL);
+        else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // --peers fixes the world size, one address per worker
+    if (peer_list) {
+        cfg.world = 0;
+        for (char *p = strtok(peer_list, ","); p && cfg.world < MAX_WORKERS; p = strtok(NULL, ",")) cfg.peers[cfg.world++] = p;
+    }
+    if ((cfg.dataset == NULL) == (cfg.synthetic <= 0) || cfg.world < 1 || cfg.world > MAX_WORKERS ||
+        cfg.rank >= cfg.world || cfg.arch_count < 2 || cfg.batch_size == 0 || cfg.epochs < 0 ||
+        !(cfg.topk_ratio > 0.0f && cfg.topk_ratio <= 1.0f)) {
+        fprintf(stderr, "Usage: %s (--dataset DIR | --synthetic N) [--workers N] [--unix PATH | --tcp HOST:PORT | --peers A,B,..]\n"
+                        "       [--rank R] [--arch 2352,128,10] [--act NAME] [--optim NAME] [--lr RATE] [--batch N]\n"
+                        "       [--epochs N] [--seed N] [--out FILE] [--no-overlap] [--compress exact|q8|topk] [--topk RATIO]\n", argv[0]);
+        return 1;
+    }
+
+    // Addresses of the launched workers, PATH.R or HOST:PORT+R
+    static char addresses[MAX_WORKERS][RING_ADDR_MAX];
+    if (!peer_list) {
+        char host[RING_ADDR_MAX / 2] = "";
+        int port = 0;
+        if (tcp) {
+            snprintf(host, sizeof(host), "%s", tcp);
+            char *colon = strrchr(host, ':');
+            if (!colon) {
+                fprintf(stderr, "Expected HOST:PORT, got %s\n", tcp);
+                return 1;
+            }
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+        char base[RING_ADDR_MAX / 2];
+        if (unix_base) snprintf(base, sizeof(base), "%s", unix_base);
+        else snprintf(base, sizeof(base), "/tmp/nn_dist_%d", cfg.rank < 0 ? (int)getpid() : 0);
+        for (int r = 0; r < cfg.world; r++) {
+            if (tcp) snprintf(addresses[r], RING_ADDR_MAX, "tcp:%s:%d", host, port + r);
+            else snprintf(addresses[r], RING_ADDR_MAX, "unix:%s.%d", base, r);
+            cfg.peers[r] = addresses[r];
+        }
+    }
+
+    return cfg.rank < 0 ? launch(&cfg) : run_worker(&cfg);
+}
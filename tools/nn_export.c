@@ -0,0 +1,171 @@
+#include "nn.h"
+#include <ctype.h>
+
+// Export a saved model as a standalone C source and header with the weights compiled in
+// Usage: nn_export [--model FILE] [--name NAME] [--out DIR]
+// Writes DIR/NAME.h and DIR/NAME.c, the only entry point is int NAME_predict(const float *input, float *scores)
+// The generated code needs nothing but libm, it reads no file and allocates nothing, and every layer size
+// is a constant so the compiler can unroll and vectorize the loops for the exact shape
+// The arithmetic runs in the same order as nn_predict, so built with the flags of this Makefile (no -ffast-math,
+// no FMA contraction) the scores are the same to the bit
+
+
+static int write_header(FILE *file, const char *name, const char *upper, const char *model, NN nn) {
+    fprintf(file, "#ifndef %s_H_\n#define %s_H_\n\n", upper, upper);
+    fprintf(file, "// Generated by nn_export from %s, do not edit\n// Architecture: %zu", model, nn.ws[0].rows);
+    for (size_t i = 0; i < nn.size; i++) {
+        fprintf(file, " -> %zu (%s)", nn.ws[i].cols, nn_activation_name(nn.acts[i]));
+    }
+    fprintf(file, "\n\n#define %s_INPUTS %zu\n#define %s_OUTPUTS %zu\n\n", upper, nn.ws[0].rows, upper, NN_OUTPUT(nn).cols);
+    fprintf(file, "// Run the network on %s_INPUTS floats, fills %s_OUTPUTS scores unless scores is NULL\n", upper, upper);
+    fprintf(file, "// Returns the predicted class, safe to call from any number of threads\n");
+    fprintf(file, "int %s_predict(const float *input, float *scores);\n\n#endif\n", name);
+    return ferror(file) ? -1 : 0;
+}
+
+// Floats are printed as hex literals so they read back exactly
+static void write_array(FILE *file, const char *name, const char *array, size_t index, const float *es, size_t count) {
+    fprintf(file, "static const float %s_%s%zu[%zu] __attribute__((aligned(64))) = {", name, array, index, count);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(file, "%s%af,", i % 8 ? " " : "\n    ", es[i]);
+    }
+    fprintf(file, "\n};\n\n");
+}
+
+// Activation of layer output aL[0..n), same expressions and order as the mat_ kernels
+static void write_activation(FILE *file, Activation act, size_t l, size_t n) {
+    switch (act) {
+    case ACT_SIGMOID:
+        fprintf(file, "    for (int j = 0; j < %zu; j++) a%zu[j] = 1.f / (1.f + expf(-a%zu[j]));\n", n, l, l);
+        break;
+    case ACT_RELU:
+        fprintf(file, "    for (int j = 0; j < %zu; j++) a%zu[j] = a%zu[j] > 0 ? a%zu[j] : 0;\n", n, l, l, l);
+        break;
+    case ACT_LEAKY_RELU:
+        fprintf(file, "    for (int j = 0; j < %zu; j++) a%zu[j] = a%zu[j] > 0 ? a%zu[j] : %af * a%zu[j];\n",
+                n, l, l, l, LEAKY_RELU_ALPHA, l);
+        break;
+    case ACT_TANH:
+        fprintf(file, "    for (int j = 0; j < %zu; j++) a%zu[j] = tanhf(a%zu[j]);\n", n, l, l);
+        break;
+    case ACT_SOFTMAX:
+        fprintf(file, "    {\n");
+        fprintf(file, "        float max = a%zu[0];\n", l);
+        fprintf(file, "        for (int j = 1; j < %zu; j++) max = a%zu[j] > max ? a%zu[j] : max;\n", n, l, l);
+        fprintf(file, "        float sum = 0.0f;\n");
+        fprintf(file, "        for (int j = 0; j < %zu; j++) {\n", n);
+        fprintf(file, "            a%zu[j] = expf(a%zu[j] - max);\n", l, l);
+        fprintf(file, "            sum += a%zu[j];\n        }\n", l);
+        fprintf(file, "        float inv = 1.0f / sum;\n");
+        fprintf(file, "        for (int j = 0; j < %zu; j++) a%zu[j] *= inv;\n    }\n", n, l);
+        break;
+    default:
+        break;
+    }
+}
+
+static int write_source(FILE *file, const char *name, const char *upper, const char *model, NN nn) {
+    (void)upper;
+    fprintf(file, "// Generated by nn_export from %s, do not edit\n", model);
+    fprintf(file, "#include \"%s.h\"\n#include <math.h>\n#include <string.h>\n\n", name);
+
+    for (size_t i = 0; i < nn.size; i++) {
+        write_array(file, name, "w", i, nn.ws[i].es, nn.ws[i].rows * nn.ws[i].cols);
+        write_array(file, name, "b", i, nn.bs[i].es, nn.bs[i].cols);
+    }
+
+    // One helper for every layer, the sizes are constants once it is inlined
+    fprintf(file, "// y = x*w + b for a single input, the sums run over k in order like mat_dot then mat_sum_row\n");
+    fprintf(file, "static inline __attribute__((always_inline))\n");
+    fprintf(file, "void %s_affine(float *restrict y, const float *restrict x, const float *restrict w, const float *restrict b, const int n_in, const int n_out) {\n", name);
+    fprintf(file, "    for (int j = 0; j < n_out; j++) y[j] = 0;\n");
+    fprintf(file, "    for (int k = 0; k < n_in; k++) {\n");
+    fprintf(file, "        float xk = x[k];\n");
+    fprintf(file, "        for (int j = 0; j < n_out; j++) y[j] += xk * w[k * n_out + j];\n");
+    fprintf(file, "    }\n");
+    fprintf(file, "    for (int j = 0; j < n_out; j++) y[j] += b[j];\n");
+    fprintf(file, "}\n\n");
+
+    fprintf(file, "int %s_predict(const float *input, float *scores) {\n", name);
+    for (size_t i = 0; i < nn.size; i++) {
+        fprintf(file, "    float a%zu[%zu] __attribute__((aligned(64)));\n", i + 1, nn.ws[i].cols);
+    }
+    for (size_t i = 0; i < nn.size; i++) {
+        fprintf(file, "\n    // Layer %zu: %zu -> %zu (%s)\n", i, nn.ws[i].rows, nn.ws[i].cols, nn_activation_name(nn.acts[i]));
+        if (i == 0) {
+            fprintf(file, "    %s_affine(a1, input, %s_w0, %s_b0, %zu, %zu);\n", name, name, name, nn.ws[i].rows, nn.ws[i].cols);
+        } else {
+            fprintf(file, "    %s_affine(a%zu, a%zu, %s_w%zu, %s_b%zu, %zu, %zu);\n",
+                    name, i + 1, i, name, i, name, i, nn.ws[i].rows, nn.ws[i].cols);
+        }
+        write_activation(file, nn.acts[i], i + 1, nn.ws[i].cols);
+    }
+
+    // First index of the highest score, like nn_argmax
+    size_t out = nn.size, classes = NN_OUTPUT(nn).cols;
+    fprintf(file, "\n    int predicted = 0;\n");
+    fprintf(file, "    for (int j = 1; j < %zu; j++) if (a%zu[j] > a%zu[predicted]) predicted = j;\n", classes, out, out);
+    fprintf(file, "    if (scores) memcpy(scores, a%zu, sizeof(a%zu));\n", out, out);
+    fprintf(file, "    return predicted;\n}\n");
+    return ferror(file) ? -1 : 0;
+}
+
+// Write one generated file, a failed write leaves no partial file behind
+typedef int (*Writer)(FILE *file, const char *name, const char *upper, const char *model, NN nn);
+
+static int write_file(const char *dir, const char *name, const char *ext, Writer write, const char *upper, const char *model, NN nn) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open %s for writing.\n", path);
+        return -1;
+    }
+    int status = write(file, name, upper, model, nn);
+    if (fclose(file) != 0) status = -1;
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write %s.\n", path);
+        remove(path);
+        return -1;
+    }
+    printf("Wrote %s\n", path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *model = "nn_configuration.txt";
+    const char *name = "nn_model";
+    const char *dir = ".";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) model = argv[++i];
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) name = argv[++i];
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) dir = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [--model FILE] [--name NAME] [--out DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // The name prefixes every generated symbol, so it has to be a C identifier
+    char upper[256];
+    size_t len = strlen(name);
+    int valid = len > 0 && len < sizeof(upper) && !isdigit((unsigned char)name[0]);
+    for (size_t i = 0; valid && i < len; i++) {
+        valid = isalnum((unsigned char)name[i]) || name[i] == '_';
+        upper[i] = toupper((unsigned char)name[i]);
+    }
+    if (!valid) {
+        fprintf(stderr, "Error: --name must be a C identifier, got '%s'.\n", name);
+        return 1;
+    }
+    upper[len] = '\0';
+
+    NN nn;
+    if (nn_try_load(model, &nn) != 0) return 1;
+
+    int status = write_file(dir, name, "h", write_header, upper, model, nn) == 0 &&
+                 write_file(dir, name, "c", write_source, upper, model, nn) == 0 ? 0 : 1;
+    nn_free(nn);
+    return status;
+}
@@ -0,0 +1,417 @@
+#include "nn.h"
+#include "registry.h"
+#include "image.h"
+#include "serve.h"
+#include "shm_ring.h"
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Long lived inference daemon on a Unix domain socket
+// Requests from all connections are queued and a single batcher thread runs them through nn_forward
+// in batches of up to max_batch, waiting at most max_wait for a batch to fill up
+// Co-located clients can attach a shared memory ring (shm_ring.h) instead, its slots are served by
+// shm_workers threads each running nn_forward directly on the slot memory, without the batcher
+// Usage: nn_server [--model FILE] [--socket PATH] [--max-batch N] [--max-wait-us N] [--shm-workers N]
+// The model file is watched by a registry.h registry, a retrained model saved over it is picked up
+// without a restart and requests already running finish on the weights they started with
+// SIGUSR1 prints the latency histogram, SIGINT / SIGTERM print it and exit
+
+
+// One queued request, lives on the stack of its connection thread until done is set
+typedef struct Pending{
+    const float *input;
+    float *scores;
+    int label;
+    int done;
+    uint64_t enqueued;
+    struct Pending *next;
+}Pending;
+
+typedef struct{
+    Registry *registry;
+    NN batch;                   // batcher context, bound to the current model for every batch
+    size_t input_size;
+    size_t num_classes;
+    size_t max_batch;
+    uint64_t max_wait_ns;
+
+    Pending *head;
+    Pending *tail;
+    size_t queued;
+    int stopped;                // the batcher is gone, nothing gets queued any more
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued_cond; // a request was queued
+    pthread_cond_t done_cond;   // a batch finished
+
+    Histogram latency;          // enqueue to result, under lock
+    uint64_t batch_sizes[65];   // batches per size, the last entry counts anything larger
+    uint64_t batches;
+
+    size_t shm_workers;
+    Histogram shm_latency;      // claim to complete on shared memory rings, merged when a ring detaches
+}Server;
+
+static Server server;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_signal(int sig) {
+    if (sig == SIGUSR1) stats_requested = 1;
+    else stop_requested = 1;
+}
+
+static void print_stats(void) {
+    pthread_mutex_lock(&server.lock);
+    histogram_print(&server.latency, stdout, "Server latency");
+    printf("Batches: %llu, sizes:", (unsigned long long)server.batches);
+    for (size_t i = 1; i < 65; i++) {
+        if (server.batch_sizes[i]) printf(" %zu%s:%llu", i, i == 64 ? "+" : "", (unsigned long long)server.batch_sizes[i]);
+    }
+    printf("\n");
+    printf("Model version %u, %u reloads, %u failed\n", server.registry->version,
+           atomic_load(&server.registry->reloads), atomic_load(&server.registry->failures));
+    if (server.shm_latency.count) histogram_print(&server.shm_latency, stdout, "Shared memory forward");
+    pthread_mutex_unlock(&server.lock);
+    fflush(stdout);
+}
+
+// Collect a batch once it is full or its oldest request has waited max_wait, then run it
+static void *batcher_thread(void *arg) {
+    (void)arg;
+    Pending **taken = malloc(server.max_batch * sizeof(*taken));
+    assert(taken != NULL);
+
+    pthread_mutex_lock(&server.lock);
+    while (!stop_requested) {
+        while (server.queued == 0 && !stop_requested) {
+            pthread_cond_wait(&server.queued_cond, &server.lock);
+        }
+        if (stop_requested) break;
+
+        uint64_t deadline = server.head->enqueued + server.max_wait_ns;
+        while (server.queued < server.max_batch && !stop_requested) {
+            uint64_t now = now_ns();
+            if (now >= deadline) break;
+            struct timespec ts = { (time_t)(deadline / 1000000000ull), (long)(deadline % 1000000000ull) };
+            pthread_cond_timedwait(&server.queued_cond, &server.lock, &ts);
+        }
+
+        size_t n = 0;
+        while (server.head && n < server.max_batch) {
+            taken[n++] = server.head;
+            server.head = server.head->next;
+        }
+        if (server.head == NULL) server.tail = NULL;
+        server.queued -= n;
+        pthread_mutex_unlock(&server.lock);
+
+        // Run the batch without holding the lock so connections keep queueing
+        Model *model = registry_acquire(server.registry);
+        NN batch = model_bind(model, server.batch);
+        nn_batch_rows(batch, n);
+        for (size_t r = 0; r < n; r++) {
+            memcpy(&MAT_AT(batch.as[0], r, 0), taken[r]->input, server.input_size * sizeof(float));
+        }
+        nn_forward(batch);
+        for (size_t r = 0; r < n; r++) {
+            taken[r]->label = nn_argmax(batch, r);
+            memcpy(taken[r]->scores, &MAT_AT(NN_OUTPUT(batch), r, 0), server.num_classes * sizeof(float));
+        }
+        registry_release(model);
+
+        pthread_mutex_lock(&server.lock);
+        uint64_t now = now_ns();
+        for (size_t r = 0; r < n; r++) {
+            taken[r]->done = 1;
+            histogram_add(&server.latency, now - taken[r]->enqueued);
+        }
+        server.batch_sizes[n < 64 ? n : 64]++;
+        server.batches++;
+        pthread_cond_broadcast(&server.done_cond);
+    }
+
+    // Answer whatever is still queued so no predict() is left waiting on its Pending
+    for (Pending *p = server.head; p; p = p->next) {
+        p->label = -1;
+        p->done = 1;
+    }
+    server.head = server.tail = NULL;
+    server.queued = 0;
+    server.stopped = 1;
+    pthread_cond_broadcast(&server.done_cond);
+    pthread_mutex_unlock(&server.lock);
+
+    free(taken);
+    return NULL;
+}
+
+// Queue one input and block until the batcher has scored it, -1 once the server is stopping
+// p lives on this stack so it is waited for even at shutdown, the batcher answers every entry it took or left queued
+static int predict(const float *input, float *scores) {
+    Pending p = { .input = input, .scores = scores, .label = -1 };
+
+    pthread_mutex_lock(&server.lock);
+    if (server.stopped) {
+        pthread_mutex_unlock(&server.lock);
+        return -1;
+    }
+    p.enqueued = now_ns();
+    if (server.tail) server.tail->next = &p;
+    else server.head = &p;
+    server.tail = &p;
+    server.queued++;
+    pthread_cond_signal(&server.queued_cond);
+
+    while (!p.done) {
+        pthread_cond_wait(&server.done_cond, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+    return p.label;
+}
+
+typedef struct{
+    ShmRing *ring;
+    Histogram latency;
+}ShmWorker;
+
+// Serve the slots of one ring, the network reads its input from the slot and writes the scores
+// straight into it so a request is never copied on the server side
+static void *shm_worker_thread(void *arg) {
+    ShmWorker *w = arg;
+    Model *first = registry_acquire(server.registry);
+    NN ctx = nn_batch_alloc(first->nn, 1);
+    registry_release(first);
+    float *own_input = ctx.as[0].es;
+    float *own_output = NN_OUTPUT(ctx).es;
+
+    int slot;
+    while ((slot = shm_ring_claim(w->ring)) >= 0) {
+        uint64_t start = now_ns();
+        Model *model = registry_acquire(server.registry);
+        NN nn = model_bind(model, ctx);
+        nn.as[0].es = shm_ring_input(w->ring, slot);
+        NN_OUTPUT(nn).es = shm_ring_scores(w->ring, slot);
+        nn_forward(nn);
+        int label = nn_argmax(nn, 0);
+        registry_release(model);
+        shm_ring_complete(w->ring, slot, label);
+        histogram_add(&w->latency, now_ns() - start);
+    }
+
+    ctx.as[0].es = own_input;
+    NN_OUTPUT(ctx).es = own_output;
+    nn_batch_free(ctx);
+    return NULL;
+}
+
+// Serve an attached ring until the client closes the connection
+static void serve_ring(int fd, const char *name) {
+    ShmRing *ring = shm_ring_open(name);
+    ServeResponse res = { .status = SERVE_OK, .label = -1 };
+    if (!ring || ring->input_size != server.input_size || ring->num_classes != server.num_classes) {
+        res.status = SERVE_BAD_RING;
+        serve_write_full(fd, &res, sizeof(res));
+        shm_ring_close(ring);
+        return;
+    }
+
+    // Serve with the workers that started, the ring is refused only if none did
+    ShmWorker *workers = calloc(server.shm_workers, sizeof(ShmWorker));
+    pthread_t *threads = malloc(server.shm_workers * sizeof(pthread_t));
+    size_t started = 0;
+    for (size_t i = 0; i < server.shm_workers; i++) {
+        workers[i].ring = ring;
+        if (pthread_create(&threads[i], NULL, shm_worker_thread, &workers[i]) != 0) break;
+        started++;
+    }
+    if (started == 0) res.status = SERVE_BAD_RING;
+    serve_write_full(fd, &res, sizeof(res));
+
+    // Nothing else is expected on the socket, its end means the client is gone
+    char byte;
+    while (started > 0 && read(fd, &byte, 1) > 0) {}
+
+    // Join before taking the lock, the batcher and every predict() need it meanwhile
+    shm_ring_stop(ring);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_lock(&server.lock);
+    for (size_t i = 0; i < started; i++) {
+        histogram_merge(&server.shm_latency, &workers[i].latency);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    shm_ring_close(ring);
+    free(workers);
+    free(threads);
+}
+
+// Serve requests of one connection in order until the client hangs up
+static void *connection_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    float *scores = malloc(server.num_classes * sizeof(float));
+    unsigned char *payload = NULL;
+    size_t payload_capacity = 0;
+
+    ServeRequest req;
+    while (serve_read_full(fd, &req, sizeof(req)) == 0) {
+        ServeResponse res = { .id = req.id, .status = SERVE_OK, .label = -1, .num_classes = server.num_classes };
+
+        if (req.magic != SERVE_MAGIC || req.kind < SERVE_TENSOR || req.kind > SERVE_SHM || req.size > (64u << 20)) {
+            res.status = SERVE_BAD_REQUEST;
+            res.num_classes = 0;
+            serve_write_full(fd, &res, sizeof(res));
+            break; // the stream can't be trusted any more
+        }
+
+        if (req.size > payload_capacity) {
+            payload_capacity = req.size;
+            payload = realloc(payload, payload_capacity);
+            assert(payload != NULL);
+        }
+        if (serve_read_full(fd, payload, req.size) != 0) break;
+
+        if (req.kind == SERVE_SHM) {
+            char name[64];
+            snprintf(name, sizeof(name), "%.*s", (int)req.size, (const char *)payload);
+            serve_ring(fd, name);
+            break;
+        }
+
+        float *decoded = NULL;
+        const float *input = NULL;
+        if (req.kind == SERVE_TENSOR) {
+            if (req.size == server.input_size * sizeof(float)) input = (const float *)payload;
+            else res.status = SERVE_BAD_REQUEST;
+        } else {
+            int width, height;
+            decoded = load_image_from_memory(payload, req.size, &width, &height);
+            if (decoded && (size_t)(width * height * 3) == server.input_size) input = decoded;
+            else res.status = SERVE_BAD_IMAGE;
+        }
+
+        if (input) {
+            res.label = predict(input, scores);
+            if (res.label < 0) res.status = SERVE_SHUTDOWN;
+        }
+        free(decoded);
+
+        if (res.status != SERVE_OK) res.num_classes = 0;
+        if (serve_write_full(fd, &res, sizeof(res)) != 0) break;
+        if (serve_write_full(fd, scores, res.num_classes * sizeof(float)) != 0) break;
+    }
+
+    close(fd);
+    free(payload);
+    free(scores);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *model = "nn_configuration.txt";
+    const char *socket_path = SERVE_DEFAULT_SOCKET;
+    size_t max_batch = 32;
+    uint64_t max_wait_us = 2000;
+    size_t shm_workers = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) model = argv[++i];
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc) max_batch = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--max-wait-us") == 0 && i + 1 < argc) max_wait_us = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--shm-workers") == 0 && i + 1 < argc) shm_workers = strtoul(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--model FILE] [--socket PATH] [--max-batch N] [--max-wait-us N] [--shm-workers N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_batch == 0) max_batch = 1;
+    if (shm_workers == 0) shm_workers = 1;
+
+    server.registry = registry_open(model);
+    if (!server.registry) return 1;
+    Model *first = registry_acquire(server.registry);
+    server.batch = nn_batch_alloc(first->nn, max_batch);
+    server.input_size = first->nn.as[0].cols;
+    server.num_classes = NN_OUTPUT(first->nn).cols;
+    registry_release(first);
+    server.max_batch = max_batch;
+    server.max_wait_ns = max_wait_us * 1000;
+    server.shm_workers = shm_workers;
+
+    // The batcher waits on CLOCK_MONOTONIC deadlines
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued_cond, &attr);
+    pthread_cond_init(&server.done_cond, NULL);
+    pthread_condattr_destroy(&attr);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0) {
+        perror("nn_server");
+        return 1;
+    }
+
+    pthread_t batcher;
+    pthread_create(&batcher, NULL, batcher_thread, NULL);
+    printf("Serving %s (%zu inputs, %zu classes) on %s, max batch %zu, max wait %llu us\n",
+           model, server.input_size, server.num_classes, socket_path, max_batch, (unsigned long long)max_wait_us);
+    fflush(stdout);
+
+    // Poll so signals are noticed between connections
+    while (!stop_requested) {
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Wake everything up so the batcher can exit
+    pthread_mutex_lock(&server.lock);
+    pthread_cond_broadcast(&server.queued_cond);
+    pthread_cond_broadcast(&server.done_cond);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(batcher, NULL);
+
+    close(listen_fd);
+    unlink(socket_path);
+    print_stats();
+    return 0;
+}